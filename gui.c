@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <errno.h>
 #include <string.h>
@@ -15,8 +16,6 @@
 
 #define ArrayLength(a) (sizeof(a) / sizeof((a)[0]))
 
-#define MAX_ATOMS 512
-#define MAX_BONDS 512
 #define MAX_CUT_EDGES (64*1024*1024)
 
 typedef float f32;
@@ -39,9 +38,9 @@ typedef struct {
     Vector2 p;
 } Atom;
 
-Atom atoms[512] = {};
+Atom* atoms = NULL;
 int  atoms_count = 0;
-int  unspecified_atom_ids[512] = {};
+int* unspecified_atom_ids = NULL;
 int  unspecified_atoms_count = 0;
 char* atom_names[] = { "X", "H", "O", "N", "C" };
 int  atom_name_widths[] = { 8, 8, 8, 8, 8 };
@@ -68,9 +67,14 @@ typedef struct {
     Solution solution;
 } Bond;
 
-Bond bonds[512];
+Bond* bonds = NULL;
 int bonds_count = 0;
 
+// Atom id for every cell of the puzzle text, or -1.
+int* grid = NULL;
+int grid_width = 0;
+int grid_height = 0;
+
 f32 zoom = 31;
 
 typedef struct {
@@ -105,12 +109,8 @@ void add_atom(int x, int y, AtomKind kind) {
 }
 
 int get_atom(int x, int y) {
-    for(int i = 0; i < atoms_count; i++) {
-        if(atoms[i].x == x && atoms[i].y == y) {
-            return i;
-        }
-    }
-    return -1;
+    if(x < 0 || y < 0 || x >= grid_width || y >= grid_height) return -1;
+    return grid[y*grid_width + x];
 }
 
 void add_bond(int x, int y, BondKind kind) {
@@ -125,6 +125,17 @@ void add_bond(int x, int y, BondKind kind) {
 void parse(char* puzzle, int len) {
     int x = 0;
     int y = 0;
+
+    // Everything is sized by a first pass over the text.
+    int atoms_capacity = 0;
+    int bonds_capacity = 0;
+    for(int i = 0; i < len; i++) {
+        if(puzzle[i] && strchr("XHONC", puzzle[i])) atoms_capacity++;
+        if(puzzle[i] && strchr("-/\\", puzzle[i])) bonds_capacity++;
+    }
+    atoms = calloc(atoms_capacity, sizeof(Atom));
+    unspecified_atom_ids = calloc(atoms_capacity, sizeof(int));
+    bonds = calloc(bonds_capacity, sizeof(Bond));
     
     for(int i = 0; i < len; i++) {
         char c = puzzle[i];
@@ -143,6 +154,16 @@ void parse(char* puzzle, int len) {
         }
     }
 
+    for(int i = 0; i < atoms_count; i++) {
+        if(atoms[i].x >= grid_width) grid_width = atoms[i].x + 1;
+        if(atoms[i].y >= grid_height) grid_height = atoms[i].y + 1;
+    }
+    grid = malloc((size_t) grid_width*grid_height*sizeof(int));
+    memset(grid, -1, (size_t) grid_width*grid_height*sizeof(int));
+    for(int i = 0; i < atoms_count; i++) {
+        grid[atoms[i].y*grid_width + atoms[i].x] = i;
+    }
+
     for(int i = 0; i < bonds_count; i++) {
         Bond* b = &bonds[i];
         switch(b->kind) {
@@ -165,8 +186,10 @@ void parse(char* puzzle, int len) {
     }
 }
 
+// A snapshot of all bonds per step, grown as needed.
 int rewindState = 0;
-Solution rewindSolution[64*1024];
+int rewindCapacity = 0;
+Solution* rewindSolution = NULL;
 
 Solution ToggleSolution(Solution solution, int inc) {
     int count = solution & 0x3;
@@ -288,10 +311,13 @@ int main() {
     fseek(fp, 0, SEEK_END);
     int length = ftell(fp);
     fseek(fp, 0, SEEK_SET);
-    char puzzle[4096];
+    char* puzzle = malloc(length);
     fread(puzzle, length, 1, fp);
     fclose(fp);
     parse(puzzle, length);
+    free(puzzle);
+    rewindCapacity = 16;
+    rewindSolution = calloc((size_t) rewindCapacity*bonds_count, sizeof(Solution));
 
     SetConfigFlags(FLAG_MSAA_4X_HINT);
     SetTraceLogLevel(LOG_WARNING);
@@ -343,6 +369,10 @@ int main() {
 
         if(change) {
             rewindState++;
+            if(rewindState >= rewindCapacity) {
+                rewindCapacity *= 2;
+                rewindSolution = realloc(rewindSolution, (size_t) rewindCapacity*bonds_count*sizeof(Solution));
+            }
             for(int i = 0; i < bonds_count; i++) {
                 rewindSolution[rewindState * bonds_count + i] = bonds[i].solution;
             }
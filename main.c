@@ -1,12 +1,21 @@
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/file.h>
 #include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <picosat.h>
 
@@ -14,15 +23,123 @@
 #define STR(x) STR_(x)
 #define MAX_SOLUTIONS 1000
 
-#define MAX_ATOMS 512
-#define MAX_BONDS 512
-#define MAX_CUT_EDGES (64*1024*1024)
+#define DEFAULT_CUT_SET_MB 64
+#define DEFAULT_TABLE_MB 16
+#define ARENA_BLOCK_SIZE (64*1024)
 
 #define min(a_, b_) ((a_) < (b_) ? (a_) : (b_))
 #define max(a_, b_) ((a_) > (b_) ? (a_) : (b_))
 #define array_length(arr_) (sizeof(arr_) / sizeof((arr_)[0]))
 #define DEBUG 0
 
+// A bump allocator. Memory comes in blocks which are chained and kept for
+// reuse, so pointers stay valid until the arena is reset or released below
+// their mark. Nothing allocated from an arena is freed on its own.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* current;
+} Arena;
+
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+// The puzzle arena holds the puzzle model and is reset by reset_puzzle().
+// The scratch arena holds temporaries, which are released by their user.
+_Thread_local Arena puzzle_arena;
+_Thread_local Arena scratch;
+
+void* arena_alloc(Arena* arena, size_t bytes) {
+    bytes = (bytes + 7) & ~(size_t) 7;
+    ArenaBlock* block = arena->current;
+    ArenaBlock* last = block;
+    while(block && block->used + bytes > block->capacity) {
+        last = block;
+        block = block->next;
+        if(block) block->used = 0;
+    }
+    if(!block) {
+        size_t capacity = max(bytes, last ? 2*last->capacity : ARENA_BLOCK_SIZE);
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        block->next = NULL;
+        block->capacity = capacity;
+        block->used = 0;
+        if(last) last->next = block;
+        else arena->first = block;
+    }
+    arena->current = block;
+    void* result = block->data + block->used;
+    block->used += bytes;
+    return result;
+}
+
+void arena_free(Arena* arena) {
+    while(arena->first) {
+        ArenaBlock* next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
+    }
+    arena->current = NULL;
+}
+
+ArenaMark arena_mark(Arena* arena) {
+    return (ArenaMark) {
+        .block = arena->current,
+        .used = arena->current ? arena->current->used : 0,
+    };
+}
+
+void arena_release(Arena* arena, ArenaMark mark) {
+    arena->current = mark.block ? mark.block : arena->first;
+    if(arena->current) arena->current->used = mark.used;
+}
+
+// Every random number is drawn from a SplitMix64 stream: the n-th number of
+// a stream is a hash of its key plus n times the golden ratio, so a stream
+// is just a key and a counter. Stream i of a run has the key
+// random_split(random_seed, i). Stream 0 belongs to the main thread,
+// chains and batch puzzles take the streams from 1 and portfolio members
+// the ones down from UINT64_MAX, so runs with the same seed and thread
+// count are identical.
+typedef struct {
+    uint64_t key;
+    uint64_t counter;
+} Random;
+
+uint64_t random_seed = 0;
+_Thread_local Random random_stream;
+
+uint64_t random_mix(uint64_t z) {
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+Random random_split(uint64_t seed, uint64_t stream) {
+    return (Random) { .key = random_mix(seed ^ random_mix(stream)) };
+}
+
+uint64_t random_next(void) {
+    return random_mix(random_stream.key + ++random_stream.counter*0x9e3779b97f4a7c15u);
+}
+
+int random_int(void) {
+    return random_next() >> 33;
+}
+
+// Uniform in [0, 1).
+double random_double(void) {
+    return (random_next() >> 11)*0x1.0p-53;
+}
+
 typedef enum {
     ATOM_UNSPECIFIED,
     ATOM_H,
@@ -37,12 +154,17 @@ typedef struct {
     int y;
     AtomKind kind;
     int mark;
+    // Whether the kind of the atom took part in the last proof that the
+    // puzzle has no solution.
+    int failed;
 } Atom;
 
-Atom atoms[512] = {};
-int  atoms_count = 0;
-int unspecified_atom_ids[512] = {};
-int  unspecified_atoms_count = 0;
+// The puzzle and all state derived from it are thread local, so that the
+// chains of --threads each work on a copy of their own.
+_Thread_local Atom* atoms = NULL;
+_Thread_local int  atoms_count = 0;
+_Thread_local int* unspecified_atom_ids = NULL;
+_Thread_local int  unspecified_atoms_count = 0;
 
 
 typedef enum {
@@ -58,17 +180,36 @@ typedef struct {
     int atom_id1;
     int atom_id2;
     int solution;
+    // The solution found before the last one, if a solve found several.
+    int alternative;
 } Bond;
 
-Bond bonds[512];
-int bonds_count = 0;
+_Thread_local Bond* bonds = NULL;
+_Thread_local int bonds_count = 0;
 
+// The bonds of an atom and the atoms at their other ends, a view into the
+// adjacency arrays built by parse().
 typedef struct {
     int count;
-    int bond_ids[3];
-    int atom_ids[3];
+    int* bond_ids;
+    int* atom_ids;
 } Link;
 
+// Adjacency in compressed sparse row form: the links of atom i are at
+// adjacency_starts[i] ..< adjacency_starts[i + 1].
+_Thread_local int* adjacency_starts = NULL;
+_Thread_local int* adjacency_bond_ids = NULL;
+_Thread_local int* adjacency_atom_ids = NULL;
+
+// Atom id for every cell of the puzzle text, or -1.
+_Thread_local int* grid = NULL;
+_Thread_local int grid_width = 0;
+_Thread_local int grid_height = 0;
+
+int get_bond_literal(int bond_id, int bond_order) {
+    return bond_id * 3 + bond_order;
+}
+
 void add_atom(int x, int y, AtomKind kind) {
     atoms[atoms_count] = (Atom){
         .x = x,
@@ -80,12 +221,8 @@ void add_atom(int x, int y, AtomKind kind) {
 }
 
 int get_atom(int x, int y) {
-    for(int i = 0; i < atoms_count; i++) {
-        if(atoms[i].x == x && atoms[i].y == y) {
-            return i;
-        }
-    }
-    return -1;
+    if(x < 0 || y < 0 || x >= grid_width || y >= grid_height) return -1;
+    return grid[y*grid_width + x];
 }
 
 void add_bond(int x, int y, BondKind kind) {
@@ -97,23 +234,270 @@ void add_bond(int x, int y, BondKind kind) {
     bonds_count++;
 }
 
-int cut_edges[MAX_CUT_EDGES];
-int cut_edges_count = 0;
-void add_to_cut_set(int bond) {
-    assert(cut_edges_count < MAX_CUT_EDGES);
-    cut_edges[cut_edges_count++] = bond;
+// The cut set stores the connectivity clauses found by solve(). They only
+// depend on the bond graph, so they are replayed into every new solver.
+// Clauses are kept sorted and hashed; duplicates and clauses subsumed by a
+// stored clause are dropped, and a new clause removes every stored clause
+// it subsumes. Once the store grows beyond max_bytes, the least used
+// clauses are evicted. A clause counts as used whenever it is found again,
+// subsumes a new clause, or is tight in a solution (exactly one of its
+// literals true).
+typedef struct {
+    int offset;
+    int count;
+    int id;
+    int uses;
+    uint64_t signature;
+    unsigned hash;
+} CutClause;
+
+typedef struct {
+    CutClause* clauses;
+    int clauses_count;
+    int clauses_capacity;
+    int* lits;
+    int lits_count;
+    int lits_capacity;
+    int* table;
+    int table_capacity;
+    int next_id;
+    int dead_count;
+    size_t max_bytes;
+} CutSet;
+
+_Thread_local CutSet cut_set = { .max_bytes = DEFAULT_CUT_SET_MB*1024*1024 };
+
+size_t cut_set_bytes(void) {
+    return cut_set.clauses_capacity*sizeof(CutClause) + cut_set.lits_capacity*sizeof(int) + cut_set.table_capacity*sizeof(int);
+}
+
+int cut_set_live_count(void) {
+    return cut_set.clauses_count - cut_set.dead_count;
 }
 
-Link get_atom_link(int atom_id) {
-    Link result = {};
-    for(int i = 0; i < bonds_count; i++) {
-        if(bonds[i].atom_id1 == atom_id || bonds[i].atom_id2 == atom_id) {
-            result.bond_ids[result.count] = i;
-            result.atom_ids[result.count] = bonds[i].atom_id1 == atom_id ? bonds[i].atom_id2 : bonds[i].atom_id1;
-            result.count++;
+unsigned cut_clause_hash(int* lits, int count) {
+    unsigned hash = 2166136261u;
+    for(int i = 0; i < count; i++) {
+        hash = (hash ^ (unsigned) lits[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int cut_clause_subset(CutClause* a, CutClause* b) {
+    if(a->count > b->count || (a->signature & ~b->signature)) return 0;
+    int* la = cut_set.lits + a->offset;
+    int* lb = cut_set.lits + b->offset;
+    int j = 0;
+    for(int i = 0; i < a->count; i++) {
+        while(j < b->count && lb[j] < la[i]) j++;
+        if(j == b->count || lb[j] != la[i]) return 0;
+    }
+    return 1;
+}
+
+void cut_set_rehash(int table_capacity) {
+    free(cut_set.table);
+    cut_set.table_capacity = table_capacity;
+    cut_set.table = malloc(table_capacity*sizeof(int));
+    memset(cut_set.table, -1, table_capacity*sizeof(int));
+    for(int i = 0; i < cut_set.clauses_count; i++) {
+        if(cut_set.clauses[i].count == 0) continue;
+        int slot = cut_set.clauses[i].hash & (table_capacity - 1);
+        while(cut_set.table[slot] >= 0) slot = (slot + 1) & (table_capacity - 1);
+        cut_set.table[slot] = i;
+    }
+}
+
+// Drops dead clauses. Clauses keep their order, so they stay sorted by id.
+void cut_set_compact(void) {
+    int clauses_count = 0;
+    int lits_count = 0;
+    for(int i = 0; i < cut_set.clauses_count; i++) {
+        CutClause clause = cut_set.clauses[i];
+        if(clause.count == 0) continue;
+        memmove(cut_set.lits + lits_count, cut_set.lits + clause.offset, clause.count*sizeof(int));
+        clause.offset = lits_count;
+        lits_count += clause.count;
+        cut_set.clauses[clauses_count++] = clause;
+    }
+    cut_set.clauses_count = clauses_count;
+    cut_set.lits_count = lits_count;
+    cut_set.dead_count = 0;
+    cut_set_rehash(cut_set.table_capacity);
+}
+
+void cut_set_kill(int index) {
+    cut_set.clauses[index].count = 0;
+    cut_set.dead_count++;
+}
+
+int cut_clause_compare_uses(const void* a, const void* b) {
+    const CutClause* ca = *(const CutClause**) a;
+    const CutClause* cb = *(const CutClause**) b;
+    if(ca->uses != cb->uses) return ca->uses - cb->uses;
+    return ca->id - cb->id;
+}
+
+// Evicts the least used (and among those the oldest) clauses until the
+// live clauses take up half of the budget, then shrinks the storage.
+void cut_set_evict(void) {
+    int live_count = cut_set_live_count();
+    CutClause** order = malloc(live_count*sizeof(CutClause*));
+    int k = 0;
+    size_t live_bytes = 0;
+    for(int i = 0; i < cut_set.clauses_count; i++) {
+        CutClause* clause = &cut_set.clauses[i];
+        if(clause->count == 0) continue;
+        order[k++] = clause;
+        live_bytes += sizeof(CutClause) + clause->count*sizeof(int);
+    }
+    qsort(order, k, sizeof(CutClause*), cut_clause_compare_uses);
+    for(int i = 0; i < k && live_bytes > cut_set.max_bytes / 2; i++) {
+        live_bytes -= sizeof(CutClause) + order[i]->count*sizeof(int);
+        cut_set_kill(order[i] - cut_set.clauses);
+    }
+    free(order);
+    cut_set_compact();
+
+    cut_set.clauses_capacity = cut_set.clauses_count + cut_set.clauses_count / 2 + 1;
+    cut_set.clauses = realloc(cut_set.clauses, cut_set.clauses_capacity*sizeof(CutClause));
+    cut_set.lits_capacity = cut_set.lits_count + cut_set.lits_count / 2 + 1;
+    cut_set.lits = realloc(cut_set.lits, cut_set.lits_capacity*sizeof(int));
+    int table_capacity = 512;
+    while(table_capacity < 2*cut_set.clauses_capacity) table_capacity *= 2;
+    cut_set_rehash(table_capacity);
+}
+
+// Adds the clause formed by the given bond literals. Returns the id of the
+// new clause, or -1 if it was already implied by the stored clauses.
+int add_to_cut_set(int* lits, int count) {
+    assert(count > 0);
+    int sorted[count];
+    memcpy(sorted, lits, count*sizeof(int));
+    for(int i = 1; i < count; i++) {
+        for(int j = i; j > 0 && sorted[j - 1] > sorted[j]; j--) {
+            int t = sorted[j]; sorted[j] = sorted[j - 1]; sorted[j - 1] = t;
         }
     }
-    return result;
+
+    if(cut_set.lits_count + count > cut_set.lits_capacity) {
+        cut_set.lits_capacity = max(2*cut_set.lits_capacity, cut_set.lits_count + count + 1024);
+        cut_set.lits = realloc(cut_set.lits, cut_set.lits_capacity*sizeof(int));
+    }
+    if(cut_set.clauses_count == cut_set.clauses_capacity) {
+        cut_set.clauses_capacity = max(2*cut_set.clauses_capacity, 256);
+        cut_set.clauses = realloc(cut_set.clauses, cut_set.clauses_capacity*sizeof(CutClause));
+    }
+    if(2*(cut_set.clauses_count + 1) > cut_set.table_capacity) {
+        cut_set_rehash(max(2*cut_set.table_capacity, 512));
+    }
+
+    CutClause clause = {
+        .offset = cut_set.lits_count,
+        .count = count,
+        .hash = cut_clause_hash(sorted, count),
+    };
+    memcpy(cut_set.lits + clause.offset, sorted, count*sizeof(int));
+    for(int i = 0; i < count; i++) {
+        clause.signature |= 1ull << (sorted[i] & 63);
+    }
+
+    int slot = clause.hash & (cut_set.table_capacity - 1);
+    while(cut_set.table[slot] >= 0) {
+        CutClause* other = &cut_set.clauses[cut_set.table[slot]];
+        if(other->hash == clause.hash && other->count == count &&
+           memcmp(cut_set.lits + other->offset, sorted, count*sizeof(int)) == 0) {
+            other->uses++;
+            return -1;
+        }
+        slot = (slot + 1) & (cut_set.table_capacity - 1);
+    }
+
+    for(int i = 0; i < cut_set.clauses_count; i++) {
+        CutClause* other = &cut_set.clauses[i];
+        if(other->count == 0) continue;
+        if(cut_clause_subset(other, &clause)) {
+            other->uses++;
+            return -1;
+        }
+        if(cut_clause_subset(&clause, other)) {
+            clause.uses += other->uses;
+            cut_set_kill(i);
+        }
+    }
+
+    clause.id = cut_set.next_id++;
+    cut_set.table[slot] = cut_set.clauses_count;
+    cut_set.clauses[cut_set.clauses_count++] = clause;
+    cut_set.lits_count += count;
+
+    if(cut_set_bytes() > cut_set.max_bytes) {
+        cut_set_evict();
+    } else if(2*cut_set.dead_count > cut_set.clauses_count) {
+        cut_set_compact();
+    }
+    return clause.id;
+}
+
+// Returns the index of the first clause with an id of at least id.
+int cut_set_find(int id) {
+    int lo = 0;
+    int hi = cut_set.clauses_count;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(cut_set.clauses[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Counts a use for every clause that is tight in the current model.
+void cut_set_mark_used(PicoSAT* ps) {
+    for(int i = 0; i < cut_set.clauses_count; i++) {
+        CutClause* clause = &cut_set.clauses[i];
+        int true_lits = 0;
+        for(int j = 0; j < clause->count && true_lits < 2; j++) {
+            if(picosat_deref(ps, cut_set.lits[clause->offset + j]) == 1) true_lits++;
+        }
+        if(true_lits == 1) clause->uses++;
+    }
+}
+
+// Makes *to a copy of *from, with the same capacities, so that both grow
+// and evict alike afterwards.
+void cut_set_assign(CutSet* to, CutSet* from) {
+    to->clauses = realloc(to->clauses, max(from->clauses_capacity, 1)*sizeof(CutClause));
+    to->lits = realloc(to->lits, max(from->lits_capacity, 1)*sizeof(int));
+    free(to->table);
+    to->table = from->table ? malloc(from->table_capacity*sizeof(int)) : NULL;
+    memcpy(to->clauses, from->clauses, from->clauses_count*sizeof(CutClause));
+    memcpy(to->lits, from->lits, from->lits_count*sizeof(int));
+    if(from->table) memcpy(to->table, from->table, from->table_capacity*sizeof(int));
+    to->clauses_count = from->clauses_count;
+    to->clauses_capacity = from->clauses_capacity;
+    to->lits_count = from->lits_count;
+    to->lits_capacity = from->lits_capacity;
+    to->table_capacity = from->table_capacity;
+    to->next_id = from->next_id;
+    to->dead_count = from->dead_count;
+    to->max_bytes = from->max_bytes;
+}
+
+void cut_set_clear(void) {
+    cut_set.clauses_count = 0;
+    cut_set.lits_count = 0;
+    cut_set.dead_count = 0;
+    cut_set.next_id = 0;
+    if(cut_set.table) memset(cut_set.table, -1, cut_set.table_capacity*sizeof(int));
+}
+
+Link get_atom_link(int atom_id) {
+    int start = adjacency_starts[atom_id];
+    return (Link) {
+        .count = adjacency_starts[atom_id + 1] - start,
+        .bond_ids = &adjacency_bond_ids[start],
+        .atom_ids = &adjacency_atom_ids[start],
+    };
 }
 
 
@@ -122,7 +506,18 @@ void parse(char* puzzle, int len) {
     int y = 0;
 
     //printf("%s\n", puzzle);
-    
+
+    // Everything is sized by a first pass over the text.
+    int atoms_capacity = 0;
+    int bonds_capacity = 0;
+    for(int i = 0; i < len; i++) {
+        if(puzzle[i] && strchr("XHONC", puzzle[i])) atoms_capacity++;
+        if(puzzle[i] && strchr("-/\\", puzzle[i])) bonds_capacity++;
+    }
+    atoms = arena_alloc(&puzzle_arena, atoms_capacity*sizeof(Atom));
+    unspecified_atom_ids = arena_alloc(&puzzle_arena, atoms_capacity*sizeof(int));
+    bonds = arena_alloc(&puzzle_arena, bonds_capacity*sizeof(Bond));
+
     for(int i = 0; i < len; i++) {
         char c = puzzle[i];
         switch(c) {
@@ -140,6 +535,18 @@ void parse(char* puzzle, int len) {
         }
     }
 
+    grid_width = 0;
+    grid_height = 0;
+    for(int i = 0; i < atoms_count; i++) {
+        grid_width = max(grid_width, atoms[i].x + 1);
+        grid_height = max(grid_height, atoms[i].y + 1);
+    }
+    grid = arena_alloc(&puzzle_arena, (size_t) grid_width*grid_height*sizeof(int));
+    memset(grid, -1, (size_t) grid_width*grid_height*sizeof(int));
+    for(int i = 0; i < atoms_count; i++) {
+        grid[atoms[i].y*grid_width + atoms[i].x] = i;
+    }
+
     for(int i = 0; i < bonds_count; i++) {
         Bond* b = &bonds[i];
         switch(b->kind) {
@@ -160,8 +567,179 @@ void parse(char* puzzle, int len) {
         }
         }
     }
+
+    // Bonds with a missing end are left out of the adjacency.
+    adjacency_starts = arena_alloc(&puzzle_arena, (atoms_count + 1)*sizeof(int));
+    adjacency_bond_ids = arena_alloc(&puzzle_arena, 2*bonds_count*sizeof(int));
+    adjacency_atom_ids = arena_alloc(&puzzle_arena, 2*bonds_count*sizeof(int));
+    memset(adjacency_starts, 0, (atoms_count + 1)*sizeof(int));
+    for(int i = 0; i < bonds_count; i++) {
+        if(bonds[i].atom_id1 < 0 || bonds[i].atom_id2 < 0) continue;
+        adjacency_starts[bonds[i].atom_id1 + 1]++;
+        adjacency_starts[bonds[i].atom_id2 + 1]++;
+    }
+    for(int i = 0; i < atoms_count; i++) {
+        adjacency_starts[i + 1] += adjacency_starts[i];
+    }
+    ArenaMark mark = arena_mark(&scratch);
+    int* fill = arena_alloc(&scratch, atoms_count*sizeof(int));
+    memcpy(fill, adjacency_starts, atoms_count*sizeof(int));
+    for(int i = 0; i < bonds_count; i++) {
+        int atom_id1 = bonds[i].atom_id1;
+        int atom_id2 = bonds[i].atom_id2;
+        if(atom_id1 < 0 || atom_id2 < 0) continue;
+        adjacency_bond_ids[fill[atom_id1]] = i;
+        adjacency_atom_ids[fill[atom_id1]++] = atom_id2;
+        adjacency_bond_ids[fill[atom_id2]] = i;
+        adjacency_atom_ids[fill[atom_id2]++] = atom_id1;
+    }
+    arena_release(&scratch, mark);
+}
+
+
+// Hashes the shape of the template, that is the positions of its atoms and
+// bonds but not the kinds of the atoms.
+uint64_t template_hash(void) {
+    uint64_t hash = 14695981039346656037ull;
+    int values[3];
+    for(int i = 0; i < atoms_count + bonds_count; i++) {
+        if(i < atoms_count) {
+            values[0] = atoms[i].x; values[1] = atoms[i].y; values[2] = -1;
+        } else {
+            Bond* b = &bonds[i - atoms_count];
+            values[0] = b->x; values[1] = b->y; values[2] = b->kind;
+        }
+        for(int j = 0; j < 3; j++) {
+            hash = (hash ^ (uint32_t) values[j]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// The connectivity clauses only depend on the bond graph, so they are
+// cached on disk per template shape. The file is a list of zero terminated
+// clauses after a header naming the template hash. New clauses are
+// appended when the program exits, unless most of the loaded clauses have
+// been subsumed in the meantime; then the file is rewritten into a
+// temporary file which replaces it. Several processes may share the
+// cache, so readers and writers take a lock on the file, and a loaded
+// clause is only trusted if it is a cut of the template.
+_Thread_local char cut_cache_file_name[1024];
+_Thread_local int cut_cache_first_new_id = 0;
+_Thread_local int cut_cache_file_clauses = 0;
+
+// Returns whether leaving out the bonds of the clause disconnects the
+// template, that is whether the clause holds in every solution.
+int cut_cache_is_cut(int* lits, int count) {
+    ArenaMark mark = arena_mark(&scratch);
+    char* removed = arena_alloc(&scratch, bonds_count);
+    char* reached = arena_alloc(&scratch, atoms_count);
+    int* stack = arena_alloc(&scratch, atoms_count*sizeof(int));
+    memset(removed, 0, bonds_count);
+    memset(reached, 0, atoms_count);
+    for(int i = 0; i < count; i++) {
+        removed[(lits[i] - get_bond_literal(0, 1)) / 3] = 1;
+    }
+    int reached_count = 1;
+    int stack_count = 1;
+    stack[0] = 0;
+    reached[0] = 1;
+    while(stack_count > 0) {
+        Link link = get_atom_link(stack[--stack_count]);
+        for(int i = 0; i < link.count; i++) {
+            if(removed[link.bond_ids[i]] || reached[link.atom_ids[i]]) continue;
+            reached[link.atom_ids[i]] = 1;
+            reached_count++;
+            stack[stack_count++] = link.atom_ids[i];
+        }
+    }
+    arena_release(&scratch, mark);
+    return reached_count < atoms_count;
+}
+
+void cut_cache_load(const char* directory) {
+    mkdir(directory, 0777);
+    snprintf(cut_cache_file_name, sizeof(cut_cache_file_name), "%s/%016" PRIx64 ".cuts", directory, template_hash());
+    FILE* fp = fopen(cut_cache_file_name, "r");
+    int dropped = 0;
+    if(fp && atoms_count > 0) {
+        flock(fileno(fp), LOCK_SH);
+        uint64_t hash = 0;
+        if(fscanf(fp, "molecularis-cuts %" SCNx64, &hash) == 1 && hash == template_hash()) {
+            int lits[max(bonds_count, 1)];
+            int count = 0;
+            int lit;
+            while(fscanf(fp, "%i", &lit) == 1) {
+                if(lit == 0) {
+                    if(count > 0 && cut_cache_is_cut(lits, count)) add_to_cut_set(lits, count);
+                    else dropped++;
+                    cut_cache_file_clauses++;
+                    count = 0;
+                } else if(lit < get_bond_literal(0, 1) || lit > get_bond_literal(bonds_count - 1, 1) ||
+                          (lit - get_bond_literal(0, 1)) % 3 != 0 || count == bonds_count) {
+                    break;
+                } else {
+                    lits[count++] = lit;
+                }
+            }
+        }
+    }
+    if(fp) fclose(fp);
+    if(dropped > 0) fprintf(stderr, "%s: dropped %i clauses which are not cuts\n", cut_cache_file_name, dropped);
+    cut_cache_first_new_id = cut_set.next_id;
 }
 
+void cut_cache_save(void) {
+    if(!cut_cache_file_name[0]) return;
+    int first_new = cut_set_find(cut_cache_first_new_id);
+    int loaded_live_count = 0;
+    for(int i = 0; i < first_new; i++) {
+        if(cut_set.clauses[i].count > 0) loaded_live_count++;
+    }
+    int rewrite = 2*loaded_live_count < cut_cache_file_clauses;
+    // The lock is held until fclose(). A writer which waited for it while
+    // another one replaced the file opens the new one.
+    FILE* fp = NULL;
+    struct stat locked, named;
+    while(1) {
+        fp = fopen(cut_cache_file_name, "a");
+        if(!fp) return;
+        flock(fileno(fp), LOCK_EX);
+        if(fstat(fileno(fp), &locked) == 0 && stat(cut_cache_file_name, &named) == 0 &&
+           locked.st_ino == named.st_ino && locked.st_dev == named.st_dev) break;
+        fclose(fp);
+    }
+    char temporary_name[sizeof(cut_cache_file_name) + 32];
+    FILE* lock_fp = NULL;
+    if(rewrite) {
+        snprintf(temporary_name, sizeof(temporary_name), "%s.%i.tmp", cut_cache_file_name, (int) getpid());
+        lock_fp = fp;
+        fp = fopen(temporary_name, "w");
+        if(!fp) {
+            fclose(lock_fp);
+            return;
+        }
+        cut_cache_file_clauses = 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    if(ftell(fp) == 0) fprintf(fp, "molecularis-cuts %016" PRIx64 "\n", template_hash());
+    for(int i = rewrite ? 0 : first_new; i < cut_set.clauses_count; i++) {
+        CutClause* clause = &cut_set.clauses[i];
+        if(clause->count == 0) continue;
+        for(int j = 0; j < clause->count; j++) {
+            fprintf(fp, "%i ", cut_set.lits[clause->offset + j]);
+        }
+        fprintf(fp, "0\n");
+        cut_cache_file_clauses++;
+    }
+    if(rewrite) {
+        if(fclose(fp) == 0) rename(temporary_name, cut_cache_file_name);
+        else remove(temporary_name);
+        fp = lock_fp;
+    }
+    fclose(fp);
+    cut_cache_first_new_id = cut_set.next_id;
+}
 
 void print(int show_solution) {
     char* bond_names_simple[3] = { "-", "/", "\\" };
@@ -184,13 +762,13 @@ void print(int show_solution) {
 }
 
 void print_file(FILE* fp) {
-    char* bond_names[3] = { "-", "/", "\\" };
-    char* atom_names[] = { "X", "H", "O", "N", "C" };
+    char bond_names[3] = { '-', '/', '\\' };
+    char atom_names[] = { 'X', 'H', 'O', 'N', 'C' };
 
     // Find bounds:
-    int min_x = 99999;
+    int min_x = INT32_MAX;
     int max_x = 0;
-    int min_y = 99999;
+    int min_y = INT32_MAX;
     int max_y = 0;
 
     for(int i = 0; i < atoms_count; i++) {
@@ -200,19 +778,23 @@ void print_file(FILE* fp) {
         max_y = max(atoms[i].y, max_y);
     }
     
+    // Render into a line buffer, one character per cell.
+    int line_width = max(max_x - min_x + 1, 0);
+    ArenaMark mark = arena_mark(&scratch);
+    char* lines = arena_alloc(&scratch, (size_t) max(max_y - min_y + 1, 0)*line_width);
+    memset(lines, ' ', (size_t) max(max_y - min_y + 1, 0)*line_width);
+    for(int i = 0; i < atoms_count; i++) {
+        lines[(atoms[i].y - min_y)*line_width + atoms[i].x - min_x] = atom_names[atoms[i].kind];
+    }
+    for(int i = 0; i < bonds_count; i++) {
+        if(bonds[i].x < min_x || bonds[i].x > max_x || bonds[i].y < min_y || bonds[i].y > max_y) continue;
+        lines[(bonds[i].y - min_y)*line_width + bonds[i].x - min_x] = bond_names[bonds[i].kind];
+    }
     for(int y = min_y; y <= max_y; y++) {
-        for(int x = min_x; x <= max_x; x++) {
-            int space = 1;
-            for(int i = 0; i < atoms_count; i++) {
-                if(atoms[i].x == x && atoms[i].y == y) { fprintf(fp, "%s", atom_names[atoms[i].kind]); space = 0; }
-            }
-            for(int i = 0; i < bonds_count; i++) {
-                if(bonds[i].x == x && bonds[i].y == y) { fprintf(fp, "%s", bond_names[bonds[i].kind]); space = 0; }
-            }
-            if(space) fprintf(fp, " ");
-        }
+        fwrite(lines + (y - min_y)*line_width, 1, line_width, fp);
         fprintf(fp, "\n");
     }
+    arena_release(&scratch, mark);
 }
 
 void print_latex(char* file_name, int show_solution) {
@@ -262,20 +844,19 @@ void print_latex(char* file_name, int show_solution) {
     fclose(fp);
 }
 
-int get_bond_literal(int bond_id, int bond_order) {
-    return bond_id * 3 + bond_order;
-}
-
-void synthesize_sum_ieq(PicoSAT* ps, int* arr, int n, int r, int sign) {
+// Every clause gets -guard appended if guard is non-zero, so the constraint
+// only applies while guard is assumed (see Session).
+void synthesize_sum_ieq(PicoSAT* ps, int* arr, int n, int r, int sign, int guard) {
     if(n == 2) {
         for(int i1 = 0; i1 <= 4; i1++) {
             for(int i2 = 0; i2 <= 4; i2++) {
                 int b1 = sign*get_bond_literal(arr[0], i1);
                 int b2 = sign*get_bond_literal(arr[1], i2);
-                int lits[3] = { 0 };
+                int lits[4] = { 0 };
                 int k = 0;
                 if(i1 > 0 && i1 < 4) lits[k++] = b1;
                 if(i2 > 0 && i2 < 4) lits[k++] = b2;
+                if(guard) lits[k++] = -guard;
                 if(i1 + i2 == r + 1) {
                     if((sign < 0 && i1 < 4 && i2 < 4)  || (sign > 0 && i1 != 0 && i2 != 0)) {
                         if(DEBUG) printf("%2i: %i %i\n", sign*r, i1, i2);
@@ -292,11 +873,12 @@ void synthesize_sum_ieq(PicoSAT* ps, int* arr, int n, int r, int sign) {
                     int b1 = sign*get_bond_literal(arr[0], i1);
                     int b2 = sign*get_bond_literal(arr[1], i2);
                     int b3 = sign*get_bond_literal(arr[2], i3);
-                    int lits[4] = { 0 };
+                    int lits[5] = { 0 };
                     int k = 0;
                     if(i1 != 0 && i1 < 4) lits[k++] = b1;
                     if(i2 != 0 && i2 < 4) lits[k++] = b2;
                     if(i3 != 0 && i3 < 4) lits[k++] = b3;
+                    if(guard) lits[k++] = -guard;
                     if(i1 + i2 + i3 == r + 1 && sign < 0 && i1  < 4 && i2  < 4 && i3  < 4) {
                         if(DEBUG) printf("%2i: %i %i %i | %2i %2i %2i | %2i %2i %2i\n", sign*r, i1, i2, i3, b1, b2, b3, lits[0], lits[1], lits[2]);
                         picosat_add_lits(ps, lits);
@@ -328,7 +910,7 @@ void test_synthesize_sum_ieq(void) {
             }
 
             for(int sign = -1; sign < 2; sign += 2) {
-                synthesize_sum_ieq(ps, bonds, n, r, sign);
+                synthesize_sum_ieq(ps, bonds, n, r, sign, 0);
             }
             //picosat_print(ps, stdout);
             int variable_count = picosat_variables(ps);
@@ -355,180 +937,3362 @@ void test_synthesize_sum_ieq(void) {
 #endif
 
 
+typedef enum {
+    CONNECTIVITY_LAZY,
+    CONNECTIVITY_EAGER,
+} Connectivity;
+
+typedef enum {
+    VALENCE_CLAUSAL,
+    VALENCE_NATIVE,
+} Valence;
+
+typedef enum {
+    ENGINE_SAT,
+    ENGINE_BACKTRACK,
+    ENGINE_FRONTIER,
+} Engine;
+
+typedef enum {
+    MUTATION_RANDOM,
+    MUTATION_DIFF,
+} Mutation;
+
+typedef enum {
+    GENERATION_KINDS,
+    GENERATION_MOLECULE,
+} Generation;
+
+typedef enum {
+    SEARCH_GREEDY,
+    SEARCH_ANNEAL,
+} Search;
+
+typedef enum {
+    STATS_NONE,
+    STATS_TABLE,
+    STATS_JSON,
+} StatsFormat;
+
+typedef struct {
+    Engine engine;
+    int fresh_solver;
+    int selectors;
+    Connectivity connectivity;
+    Valence valence;
+    int single_cut;
+    int threads;
+    int share_cuts;
+    int portfolio;
+    Mutation mutation;
+    Generation generation;
+    int core_repairs;
+    Search search;
+    int table_memory;
+    StatsFormat stats;
+    int interactive;
+    const char* progress_file_name;
+    int batch_count;
+    const char* out_directory;
+    const char* cache_directory;
+} Options;
+
+Options options = {
+    .mutation = MUTATION_DIFF,
+    .table_memory = DEFAULT_TABLE_MB,
+    .cache_directory = "cache",
+};
+
 typedef struct {
     int num_solutions;
     int num_decisions;
 } SolveValue;
 
-SolveValue solve(int max_solutions) {
+// Counters of the solvers, summed over all solves of a run. The times are
+// in seconds: encoding covers building the formula and swapping the
+// constraints of mutated atoms in and out, solving a whole solve including
+// the refinement loop, and sat the calls of picosat_sat alone.
+typedef struct {
+    long long sat_calls;
+    long long cegar_iterations;
+    long long cuts_added;
+    long long blocking_clauses;
+    long long solves;
+    long long decisions;
+    long long propagations;
+    long long visits;
+    double encode_seconds;
+    double sat_seconds;
+    double solve_seconds;
+    double max_solve_seconds;
+    size_t max_bytes;
+    int max_clauses;
+    // Candidates of the generator found in and missing from its
+    // transposition table.
+    long long table_hits;
+    long long table_misses;
+} Stats;
+
+_Thread_local Stats stats = {};
+
+double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void stats_add(Stats* total, Stats* other) {
+    total->sat_calls += other->sat_calls;
+    total->cegar_iterations += other->cegar_iterations;
+    total->cuts_added += other->cuts_added;
+    total->blocking_clauses += other->blocking_clauses;
+    total->solves += other->solves;
+    total->decisions += other->decisions;
+    total->propagations += other->propagations;
+    total->visits += other->visits;
+    total->encode_seconds += other->encode_seconds;
+    total->sat_seconds += other->sat_seconds;
+    total->solve_seconds += other->solve_seconds;
+    total->max_solve_seconds = max(total->max_solve_seconds, other->max_solve_seconds);
+    total->max_bytes = max(total->max_bytes, other->max_bytes);
+    total->max_clauses = max(total->max_clauses, other->max_clauses);
+    total->table_hits += other->table_hits;
+    total->table_misses += other->table_misses;
+}
+
+void stats_solved(double start) {
+    double elapsed = seconds() - start;
+    stats.solves++;
+    stats.solve_seconds += elapsed;
+    stats.max_solve_seconds = max(stats.max_solve_seconds, elapsed);
+}
+
+// Prints the totals of the run and the means per solve, as a table or as a
+// JSON object.
+void stats_print(FILE* fp, Stats* s, int json) {
+    struct {
+        char* name;
+        char* key;
+        double total;
+    } rows[] = {
+        { "solves",            "solves",           s->solves },
+        { "solve time (ms)",   "solve_ms",         1000*s->solve_seconds },
+        { "encoding time (ms)", "encode_ms",       1000*s->encode_seconds },
+        { "sat time (ms)",     "sat_ms",           1000*s->sat_seconds },
+        { "sat calls",         "sat_calls",        s->sat_calls },
+        { "refinements",       "refinements",      s->cegar_iterations },
+        { "cut clauses",       "cut_clauses",      s->cuts_added },
+        { "blocking clauses",  "blocking_clauses", s->blocking_clauses },
+        { "decisions",         "decisions",        s->decisions },
+        { "propagations",      "propagations",     s->propagations },
+        { "visits",            "visits",           s->visits },
+    };
+    double solves = max(s->solves, 1);
+    if(json) {
+        fprintf(fp, "{");
+        for(int i = 0; i < (int) array_length(rows); i++) fprintf(fp, "\"%s\": %.6g, ", rows[i].key, rows[i].total);
+        fprintf(fp, "\"max_solve_ms\": %.6g, \"max_picosat_bytes\": %zu, \"max_clauses\": %i, \"table_hits\": %lli, "
+                "\"table_misses\": %lli, \"per_solve\": {",
+                1000*s->max_solve_seconds, s->max_bytes, s->max_clauses, s->table_hits, s->table_misses);
+        for(int i = 1; i < (int) array_length(rows); i++) {
+            fprintf(fp, "\"%s\": %.6g%s", rows[i].key, rows[i].total / solves, i + 1 < (int) array_length(rows) ? ", " : "");
+        }
+        fprintf(fp, "}}\n");
+        return;
+    }
+    fprintf(fp, "%-20s %14s %12s\n", "", "total", "per solve");
+    for(int i = 0; i < (int) array_length(rows); i++) {
+        fprintf(fp, "%-20s %14.1f %12.3f\n", rows[i].name, rows[i].total, rows[i].total / solves);
+    }
+    fprintf(fp, "%-20s %14.3f\n", "max solve time (ms)", 1000*s->max_solve_seconds);
+    fprintf(fp, "%-20s %14zu\n", "max picosat KB", s->max_bytes / 1024);
+    fprintf(fp, "%-20s %14i\n", "max clauses", s->max_clauses);
+    fprintf(fp, "%-20s %14lli\n", "table hits", s->table_hits);
+    fprintf(fp, "%-20s %14lli\n", "table misses", s->table_misses);
+}
+
+// A solver session keeps one PicoSAT instance alive across many solves, so
+// learned clauses, phases and scores survive mutations of the atom kinds.
+// The valence constraint of each atom is guarded by a selector literal which
+// is assumed on every call. If the kind of an atom changes, the old
+// selector is retired by a unit clause and the constraint for the new kind
+// is encoded under a fresh selector.
+//
+// With options.selectors the constraints for every possible kind of every
+// atom are encoded once when the session is created, each under its own
+// selector. A solve then only picks the selectors of the current kinds as
+// assumptions and never touches the formula.
+typedef struct {
+    PicoSAT* ps;
+    AtomKind* encoded_kinds;
+    int* atom_selectors;
+    int (*kind_selectors)[ATOM_MAX];
+    int next_cut_id;
+} Session;
+
+void session_encode_kind(Session* session, int atom_id, AtomKind kind, int selector) {
+    PicoSAT* ps = session->ps;
+    Link link = get_atom_link(atom_id);
+    if(options.valence == VALENCE_NATIVE) {
+        // The bond order is the number of true unary literals of a bond, so
+        // the valence is a cardinality constraint over all of them.
+        int lits[3*3 + 1];
+        int k = 0;
+        for(int i = 0; i < link.count; i++) {
+            for(int order = 1; order <= 3; order++) lits[k++] = get_bond_literal(link.bond_ids[i], order);
+        }
+        lits[k] = 0;
+        int lower = kind != ATOM_UNSPECIFIED ? (int) kind : 0;
+        int upper = kind != ATOM_UNSPECIFIED ? (int) kind : 4;
+        picosat_add_card(ps, selector, lower, upper, lits);
+    } else if(kind != ATOM_UNSPECIFIED) {
+        synthesize_sum_ieq(ps, link.bond_ids, link.count, kind,  1, selector);
+        synthesize_sum_ieq(ps, link.bond_ids, link.count, kind, -1, selector);
+    } else {
+        synthesize_sum_ieq(ps, link.bond_ids, link.count, 4, -1, selector);
+    }
+    // Selectors should only ever be set by assumptions.
+    picosat_set_default_phase_lit(ps, selector, -1);
+    picosat_set_less_important_lit(ps, selector);
+}
+
+// Encodes connectivity eagerly instead of refining the lazy cut loop in
+// session_solve(). reach[a][d] states that atom a is reachable from atom 0
+// by a path of at most d bonds; it requires reach[a][d-1] or a neighbour
+// reachable within d-1 bonds over a bond of order at least one. Every atom
+// has to be reachable within atoms_count-1 bonds. reach[a][d] is left out
+// for d below the graph distance of a, where it is false anyway.
+void session_encode_connectivity(Session* session) {
+    PicoSAT* ps = session->ps;
+    ArenaMark mark = arena_mark(&scratch);
+    int* distance = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* queue = arena_alloc(&scratch, atoms_count*sizeof(int));
+    for(int i = 0; i < atoms_count; i++) distance[i] = -1;
+    int queue_count = 1;
+    queue[0] = 0;
+    distance[0] = 0;
+    for(int q = 0; q < queue_count; q++) {
+        Link link = get_atom_link(queue[q]);
+        for(int i = 0; i < link.count; i++) {
+            if(distance[link.atom_ids[i]] < 0) {
+                distance[link.atom_ids[i]] = distance[queue[q]] + 1;
+                queue[queue_count++] = link.atom_ids[i];
+            }
+        }
+    }
+
+    // 0 means false, -1 true, anything else is the literal of reach[a][d].
+    int* previous = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* current = arena_alloc(&scratch, atoms_count*sizeof(int));
+    for(int i = 0; i < atoms_count; i++) previous[i] = i == 0 ? -1 : 0;
+    for(int d = 1; d < atoms_count; d++) {
+        for(int a = 0; a < atoms_count; a++) {
+            if(a == 0) { current[a] = -1; continue; }
+            if(distance[a] < 0 || distance[a] > d) { current[a] = 0; continue; }
+            int reach = picosat_inc_max_var(ps);
+            Link link = get_atom_link(a);
+            int supports[3] = { 0 };
+            for(int i = 0; i < link.count; i++) {
+                int neighbour = previous[link.atom_ids[i]];
+                int bond = get_bond_literal(link.bond_ids[i], 1);
+                if(neighbour == -1) {
+                    supports[i] = bond;
+                } else if(neighbour != 0) {
+                    supports[i] = picosat_inc_max_var(ps);
+                    picosat_add_arg(ps, -supports[i], neighbour, 0);
+                    picosat_add_arg(ps, -supports[i], bond, 0);
+                }
+            }
+            picosat_add(ps, -reach);
+            if(previous[a]) picosat_add(ps, previous[a]);
+            for(int i = 0; i < link.count; i++) {
+                if(supports[i]) picosat_add(ps, supports[i]);
+            }
+            picosat_add(ps, 0);
+            current[a] = reach;
+        }
+        memcpy(previous, current, atoms_count*sizeof(int));
+    }
+    for(int a = 1; a < atoms_count; a++) {
+        // An atom without a path to atom 0 leaves the empty clause.
+        if(previous[a]) picosat_add(ps, previous[a]);
+        picosat_add(ps, 0);
+    }
+    arena_release(&scratch, mark);
+}
+
+Session* session_create(void) {
+    double start = seconds();
+    Session* session = calloc(1, sizeof(Session));
+    session->encoded_kinds = malloc(atoms_count*sizeof(AtomKind));
+    session->atom_selectors = calloc(atoms_count, sizeof(int));
+    session->kind_selectors = calloc(atoms_count, sizeof(*session->kind_selectors));
     PicoSAT* ps = picosat_init();
-    picosat_set_seed(ps, time(0));
+    // Peeks at the random stream instead of drawing from it, so the choices
+    // of the generator do not depend on how many solvers it creates.
+    picosat_set_seed(ps, random_mix(random_stream.key ^ random_stream.counter));
     picosat_set_global_default_phase(ps, 3);
+    // Bond literals come first, selectors are allocated after them.
+    picosat_adjust(ps, get_bond_literal(bonds_count - 1, 3));
+    session->ps = ps;
 
-    for(int i = 0; i < cut_edges_count; i++) {
-        picosat_add(ps, cut_edges[i]);
-    }
-    
     for(int i = 0; i < bonds_count; i++) {
         int e1 = get_bond_literal(i, 1);
         int e2 = get_bond_literal(i, 2);
         int e3 = get_bond_literal(i, 3);
-        picosat_add_arg(ps, e1, -e2, 0);        
-        picosat_add_arg(ps, e2, -e3, 0);        
+        picosat_add_arg(ps, e1, -e2, 0);
+        picosat_add_arg(ps, e2, -e3, 0);
     }
     for(int i = 0; i < atoms_count; i++) {
-        Link link = get_atom_link(i);
-        if(atoms[i].kind != ATOM_UNSPECIFIED) {
-            synthesize_sum_ieq(ps, link.bond_ids, link.count, atoms[i].kind,  1);
-            synthesize_sum_ieq(ps, link.bond_ids, link.count, atoms[i].kind, -1);
-        } else {
-            synthesize_sum_ieq(ps, link.bond_ids, link.count, 4, -1);
-        }
+        session->encoded_kinds[i] = ATOM_MAX;
     }
-
-    int variable_count = picosat_variables(ps);
-    int num_decisions = 0;
-    int solutions_count = 0;
-    while(solutions_count < max_solutions) {
-        int result = picosat_sat(ps, -1);
-
-        if(result != PICOSAT_SATISFIABLE) break;
+    if(options.selectors) {
         for(int i = 0; i < atoms_count; i++) {
-            atoms[i].mark = 0;
-        }
-        int connected_atoms[MAX_ATOMS] = { 0 };
-        int connected_atoms_count = 1;
-        atoms[0].mark = 1;
-
-        int new_cut_edges[MAX_BONDS + 1] = { };
-        int new_cut_edges_count = 0;
-        int visited_atoms = 0;
-        while(visited_atoms < connected_atoms_count) {
-            int atom = connected_atoms[visited_atoms];
-            Link link = get_atom_link(atom);
-            for(int i = 0; i < link.count; i++) {
-                if(!atoms[link.atom_ids[i]].mark) {
-                    if(picosat_deref(ps, get_bond_literal(link.bond_ids[i], 1)) == 1) {
-                        atoms[link.atom_ids[i]].mark = 1;
-                        connected_atoms[connected_atoms_count++] = link.atom_ids[i];
-                    } else {
-                        new_cut_edges[new_cut_edges_count++] = link.bond_ids[i];
-                    }
+            for(int kind = 0; kind < ATOM_MAX; kind++) {
+                int selector = picosat_inc_max_var(ps);
+                session_encode_kind(session, i, kind, selector);
+                // At most one kind per atom.
+                for(int other = 0; other < kind; other++) {
+                    picosat_add_arg(ps, -session->kind_selectors[i][other], -selector, 0);
                 }
+                session->kind_selectors[i][kind] = selector;
             }
-            visited_atoms++;
         }
-        for(int i = 0; i < new_cut_edges_count; ) {
-            int a1 = bonds[new_cut_edges[i]].atom_id1;
-            int a2 = bonds[new_cut_edges[i]].atom_id2;
-            int sum = atoms[a1].mark + atoms[a2].mark;
-            if(sum == 2) {
-                new_cut_edges[i] = new_cut_edges[--new_cut_edges_count];
-            } else {
-                assert(sum == 1);
-                new_cut_edges[i] = get_bond_literal(new_cut_edges[i], 1);
-                i++;
-            }
+    }
+    if(options.connectivity == CONNECTIVITY_EAGER) session_encode_connectivity(session);
+    stats.encode_seconds += seconds() - start;
+    return session;
+}
+
+void session_destroy(Session* session) {
+    picosat_reset(session->ps);
+    free(session->encoded_kinds);
+    free(session->atom_selectors);
+    free(session->kind_selectors);
+    free(session);
+}
+
+void session_encode_atom(Session* session, int atom_id) {
+    PicoSAT* ps = session->ps;
+    AtomKind kind = atoms[atom_id].kind;
+    int selector;
+    if(options.selectors) {
+        selector = session->kind_selectors[atom_id][kind];
+    } else {
+        if(session->atom_selectors[atom_id]) {
+            picosat_add_arg(ps, -session->atom_selectors[atom_id], 0);
         }
-        
-        if(connected_atoms_count == atoms_count) {
-            if(solutions_count == 0) num_decisions = picosat_decisions(ps);
-            for(int i = 0; i < bonds_count; i++) {
-                bonds[i].solution = 0;
-                for(int j = 1; j <= 3; j++) {
-                    if(picosat_deref(ps, get_bond_literal(i, j)) == 1) {
-                        bonds[i].solution = j;
-                    }
+        selector = picosat_inc_max_var(ps);
+        session_encode_kind(session, atom_id, kind, selector);
+    }
+    session->atom_selectors[atom_id] = selector;
+    session->encoded_kinds[atom_id] = kind;
+}
+
+// Labels the connected components formed by the bonds of the current model
+// in atoms[].mark, starting at 1 with the component of atom 0. Returns the
+// number of components.
+int label_components(PicoSAT* ps) {
+    for(int i = 0; i < atoms_count; i++) {
+        atoms[i].mark = 0;
+    }
+    ArenaMark mark = arena_mark(&scratch);
+    int* queue = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int components_count = 0;
+    for(int root = 0; root < atoms_count; root++) {
+        if(atoms[root].mark) continue;
+        components_count++;
+        atoms[root].mark = components_count;
+        queue[0] = root;
+        int queue_count = 1;
+        for(int q = 0; q < queue_count; q++) {
+            Link link = get_atom_link(queue[q]);
+            for(int i = 0; i < link.count; i++) {
+                if(!atoms[link.atom_ids[i]].mark && picosat_deref(ps, get_bond_literal(link.bond_ids[i], 1)) == 1) {
+                    atoms[link.atom_ids[i]].mark = components_count;
+                    queue[queue_count++] = link.atom_ids[i];
                 }
             }
-            int negative_assignment[variable_count + 1];
-            int set_variables = 0;
+        }
+    }
+    arena_release(&scratch, mark);
+    return components_count;
+}
+
+// Collects the literals of the bonds between different components, grouped
+// by component: the cut of component c is lits[starts[c]] ..< lits[starts[c + 1]].
+// starts needs components_count + 2 entries and lits two per bond.
+void component_cuts(int components_count, int* starts, int* lits) {
+    memset(starts, 0, (components_count + 2)*sizeof(int));
+    for(int i = 0; i < bonds_count; i++) {
+        if(bonds[i].atom_id1 < 0 || bonds[i].atom_id2 < 0) continue;
+        int m1 = atoms[bonds[i].atom_id1].mark;
+        int m2 = atoms[bonds[i].atom_id2].mark;
+        if(m1 == m2) continue;
+        starts[m1 + 1]++;
+        starts[m2 + 1]++;
+    }
+    for(int c = 1; c <= components_count + 1; c++) {
+        starts[c] += starts[c - 1];
+    }
+    // Filling moves starts[c] to the end of the cut of c, which is where
+    // the cut of c + 1 begins.
+    for(int i = 0; i < bonds_count; i++) {
+        if(bonds[i].atom_id1 < 0 || bonds[i].atom_id2 < 0) continue;
+        int m1 = atoms[bonds[i].atom_id1].mark;
+        int m2 = atoms[bonds[i].atom_id2].mark;
+        if(m1 == m2) continue;
+        lits[starts[m1]++] = get_bond_literal(i, 1);
+        lits[starts[m2]++] = get_bond_literal(i, 1);
+    }
+    for(int c = components_count + 1; c > 0; c--) {
+        starts[c] = starts[c - 1];
+    }
+    starts[0] = 0;
+}
+
+SolveValue session_solve(Session* session, int max_solutions) {
+    PicoSAT* ps = session->ps;
+    double start = seconds();
+
+    for(int i = cut_set_find(session->next_cut_id); i < cut_set.clauses_count; i++) {
+        CutClause* clause = &cut_set.clauses[i];
+        if(clause->count == 0) continue;
+        for(int j = 0; j < clause->count; j++) {
+            picosat_add(ps, cut_set.lits[clause->offset + j]);
+        }
+        picosat_add(ps, 0);
+    }
+    session->next_cut_id = cut_set.next_id;
+
+    for(int i = 0; i < atoms_count; i++) {
+        if(session->encoded_kinds[i] != atoms[i].kind) session_encode_atom(session, i);
+    }
+    stats.encode_seconds += seconds() - start;
+
+    // Blocking clauses only hold for this solve, so they are guarded by
+    // their own selector, which is retired at the end.
+    int blocking_selector = picosat_inc_max_var(ps);
+    unsigned long long decisions = picosat_decisions(ps);
+    unsigned long long propagations = picosat_propagations(ps);
+    unsigned long long visits = picosat_visits(ps);
+
+    int num_decisions = 0;
+    int solutions_count = 0;
+    int result = PICOSAT_UNKNOWN;
+    while(solutions_count < max_solutions) {
+        for(int i = 0; i < atoms_count; i++) {
+            picosat_assume(ps, session->atom_selectors[i]);
+        }
+        picosat_assume(ps, blocking_selector);
+        double sat_start = seconds();
+        result = picosat_sat(ps, -1);
+        stats.sat_seconds += seconds() - sat_start;
+        stats.sat_calls++;
+
+        if(result != PICOSAT_SATISFIABLE) break;
+        int components_count = label_components(ps);
+        if(components_count == 1) {
+            if(solutions_count == 0) num_decisions = picosat_decisions(ps) - decisions;
+            cut_set_mark_used(ps);
+            for(int i = 0; i < bonds_count; i++) {
+                bonds[i].alternative = bonds[i].solution;
+                bonds[i].solution = 0;
+                for(int j = 1; j <= 3; j++) {
+                    if(picosat_deref(ps, get_bond_literal(i, j)) == 1) {
+                        bonds[i].solution = j;
+                    }
+                }
+            }
+            // The blocking clause is projected onto the bond orders: a
+            // bond of order v differs from this solution iff its literal for
+            // v is false or its literal for v+1 is true. Auxiliary variables
+            // must not tell solutions apart, and literals fixed at the top
+            // level cannot make a difference.
+            int negative_assignment[2*bonds_count + 2];
+            int set_variables = 0;
             solutions_count++;
-            for(int i = 1; i <= variable_count; i++) {
-                int x = picosat_deref(ps, i);
-                
-                if(x ==  1) negative_assignment[set_variables++] = -i;
-                if(x == -1) negative_assignment[set_variables++] =  i;
+            for(int i = 0; i < bonds_count; i++) {
+                int v = bonds[i].solution;
+                if(v >= 1 && !picosat_deref_toplevel(ps, get_bond_literal(i, v))) {
+                    negative_assignment[set_variables++] = -get_bond_literal(i, v);
+                }
+                if(v <= 2 && !picosat_deref_toplevel(ps, get_bond_literal(i, v + 1))) {
+                    negative_assignment[set_variables++] = get_bond_literal(i, v + 1);
+                }
+            }
+            negative_assignment[set_variables++] = -blocking_selector;
+            negative_assignment[set_variables++] = 0;
+            picosat_add_lits(ps, negative_assignment);
+            stats.blocking_clauses++;
+        } else {
+            stats.cegar_iterations++;
+            ArenaMark mark = arena_mark(&scratch);
+            int* starts = arena_alloc(&scratch, (components_count + 2)*sizeof(int));
+            int* cut_edges = arena_alloc(&scratch, 2*bonds_count*sizeof(int));
+            component_cuts(components_count, starts, cut_edges);
+            // Every component yields a cut. The one with the largest
+            // boundary is left out, as it is the union of the others if
+            // those are all connected to it.
+            int largest = -1;
+            int largest_count = -1;
+            int cuts_count = 0;
+            if(!options.single_cut) {
+                for(int c = 1; c <= components_count; c++) {
+                    int count = starts[c + 1] - starts[c];
+                    if(count > largest_count) {
+                        largest = c;
+                        largest_count = count;
+                    }
+                }
+            }
+            for(int c = 1; c <= (options.single_cut ? 1 : components_count); c++) {
+                if(c == largest) continue;
+                int* new_cut_edges = cut_edges + starts[c];
+                int new_cut_edges_count = starts[c + 1] - starts[c];
+                if(new_cut_edges_count == 0) continue;
+                for(int i = 0; i < new_cut_edges_count; i++) {
+                    picosat_add(ps, new_cut_edges[i]);
+                }
+                picosat_add(ps, 0);
+                stats.cuts_added++;
+                cuts_count++;
+                int id = add_to_cut_set(new_cut_edges, new_cut_edges_count);
+                if(id == session->next_cut_id) session->next_cut_id++;
+            }
+            arena_release(&scratch, mark);
+            // Without a cut some component has no bond to the rest of the
+            // template, so no model will ever be connected.
+            if(cuts_count == 0) {
+                for(int i = 0; i < atoms_count; i++) atoms[i].failed = 0;
+                break;
+            }
+        }
+
+    }
+    // The kinds enter as assumptions, so the failed ones form a core of
+    // atoms whose kinds alone leave no solution. Adding the clause below
+    // invalidates the assumptions, so they are read out before.
+    if(solutions_count == 0 && result == PICOSAT_UNSATISFIABLE) {
+        for(int i = 0; i < atoms_count; i++) {
+            atoms[i].failed = picosat_failed_assumption(ps, session->atom_selectors[i]);
+        }
+    }
+    picosat_add_arg(ps, -blocking_selector, 0);
+    stats.decisions += picosat_decisions(ps) - decisions;
+    stats.propagations += picosat_propagations(ps) - propagations;
+    stats.visits += picosat_visits(ps) - visits;
+    stats.max_bytes = max(stats.max_bytes, picosat_max_bytes_allocated(ps));
+    stats.max_clauses = max(stats.max_clauses, picosat_added_original_clauses(ps));
+    stats_solved(start);
+    return (SolveValue) {
+        .num_solutions = solutions_count,
+        .num_decisions = num_decisions,
+    };
+}
+
+// A dedicated solver for the puzzle: a depth first search over the bond
+// orders. The domain of a bond is a bitset of its possible orders 0..3 and
+// the valence of an atom a bitset of the allowed sums of its bond orders.
+// The residual valence left for the undecided bonds of an atom is implied
+// by the domains of its decided ones. After every decision the domains are
+// narrowed along the links of each atom until every remaining order can
+// still be completed to an allowed sum, and the search backs off as soon as
+// the bonds which may still exist no longer connect all atoms.
+typedef struct {
+    int bond_id;
+    unsigned char domain;
+} BacktrackChange;
+
+typedef struct {
+    Link* links;
+    unsigned* valences;
+    int* weights;
+    int* sides;
+    // Atoms to narrow from, room for two per atom.
+    int* queue;
+    // Every change of a domain is recorded with its old value, so the search
+    // can undo it. Domains only shrink, so a branch of the search changes
+    // each of them at most three times.
+    BacktrackChange* trail;
+    int trail_count;
+    int bipartite;
+    int max_solutions;
+    int solutions_count;
+    int num_decisions;
+    int decisions;
+} Backtrack;
+
+_Thread_local Backtrack backtrack;
+
+void backtrack_set(unsigned char* domains, int bond_id, unsigned char domain) {
+    backtrack.trail[backtrack.trail_count++] = (BacktrackChange) { bond_id, domains[bond_id] };
+    domains[bond_id] = domain;
+}
+
+void backtrack_undo(unsigned char* domains, int trail_count) {
+    while(backtrack.trail_count > trail_count) {
+        BacktrackChange* change = &backtrack.trail[--backtrack.trail_count];
+        domains[change->bond_id] = change->domain;
+    }
+}
+
+// Returns the bitset of the sums the bonds of an atom can reach, leaving out
+// the bond at index skip of its link.
+unsigned backtrack_sums(unsigned char* domains, Link* link, int skip) {
+    unsigned sums = 1;
+    for(int i = 0; i < link->count; i++) {
+        if(i == skip) continue;
+        unsigned next = 0;
+        for(int order = 0; order <= 3; order++) {
+            if(domains[link->bond_ids[i]] & (1 << order)) next |= sums << order;
+        }
+        sums = next;
+    }
+    return sums;
+}
+
+// Narrows the domains until they are consistent with the valences of all
+// atoms, starting with the atoms in queue. Returns 0 if a domain runs empty.
+int backtrack_propagate(unsigned char* domains, int* queue, int queue_count) {
+    ArenaMark mark = arena_mark(&scratch);
+    char* queued = arena_alloc(&scratch, atoms_count);
+    memset(queued, 0, atoms_count);
+    int count = 0;
+    for(int q = 0; q < queue_count; q++) {
+        if(queued[queue[q]]) continue;
+        queued[queue[q]] = 1;
+        queue[count++] = queue[q];
+    }
+    queue_count = count;
+    // The queue is a ring, since an atom is queued at most once.
+    int head = 0;
+    int result = 1;
+    while(queue_count > 0 && result) {
+        int atom_id = queue[head];
+        head = (head + 1) % atoms_count;
+        queue_count--;
+        stats.propagations++;
+        queued[atom_id] = 0;
+        Link* link = &backtrack.links[atom_id];
+        for(int i = 0; i < link->count; i++) {
+            int bond_id = link->bond_ids[i];
+            unsigned others = backtrack_sums(domains, link, i);
+            unsigned char domain = 0;
+            for(int order = 0; order <= 3; order++) {
+                if((domains[bond_id] & (1 << order)) && ((others << order) & backtrack.valences[atom_id])) {
+                    domain |= 1 << order;
+                }
+            }
+            if(domain == domains[bond_id]) continue;
+            if(!domain) {
+                backtrack.weights[atom_id]++;
+                result = 0;
+                break;
+            }
+            backtrack_set(domains, bond_id, domain);
+            int neighbours[2] = { link->atom_ids[i], atom_id };
+            for(int j = 0; j < 2; j++) {
+                if(queued[neighbours[j]]) continue;
+                queued[neighbours[j]] = 1;
+                queue[(head + queue_count) % atoms_count] = neighbours[j];
+                queue_count++;
+            }
+        }
+    }
+    arena_release(&scratch, mark);
+    return result;
+}
+
+// Checks that the bonds which may still have a positive order connect all
+// atoms. A bridge of this graph has to be present in every solution, so
+// order 0 is removed from its domain and its atoms are added to queue.
+// Returns the number of queued atoms, or -1 if the graph is disconnected.
+int backtrack_connect(unsigned char* domains, int* queue) {
+    // Iterative depth first search computing the lowest discovery time
+    // reachable from each subtree, as in Tarjan's bridge finding.
+    ArenaMark mark = arena_mark(&scratch);
+    int* discovered = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* low = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* parent_bonds = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* next_links = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* stack = arena_alloc(&scratch, atoms_count*sizeof(int));
+    memset(discovered, 0, atoms_count*sizeof(int));
+    int stack_count = 1;
+    int time = 1;
+    int queue_count = 0;
+    stack[0] = 0;
+    discovered[0] = low[0] = time++;
+    parent_bonds[0] = -1;
+    next_links[0] = 0;
+    while(stack_count > 0) {
+        int atom_id = stack[stack_count - 1];
+        Link* link = &backtrack.links[atom_id];
+        if(next_links[atom_id] < link->count) {
+            int i = next_links[atom_id]++;
+            int bond_id = link->bond_ids[i];
+            if(!(domains[bond_id] & ~1) || bond_id == parent_bonds[atom_id]) continue;
+            int other = link->atom_ids[i];
+            if(discovered[other]) {
+                low[atom_id] = min(low[atom_id], discovered[other]);
+            } else {
+                discovered[other] = low[other] = time++;
+                parent_bonds[other] = bond_id;
+                next_links[other] = 0;
+                stack[stack_count++] = other;
+            }
+        } else {
+            stack_count--;
+            if(stack_count == 0) break;
+            int parent = stack[stack_count - 1];
+            low[parent] = min(low[parent], low[atom_id]);
+            int bond_id = parent_bonds[atom_id];
+            if(low[atom_id] > discovered[parent] && (domains[bond_id] & 1)) {
+                backtrack_set(domains, bond_id, domains[bond_id] & ~1);
+                queue[queue_count++] = atom_id;
+                queue[queue_count++] = parent;
+            }
+        }
+    }
+    if(time - 1 < atoms_count) {
+        // Blame the atoms on the border of the part which was cut off.
+        for(int i = 0; i < bonds_count; i++) {
+            int atom_id1 = bonds[i].atom_id1;
+            int atom_id2 = bonds[i].atom_id2;
+            if(atom_id1 < 0 || atom_id2 < 0) continue;
+            if(!discovered[atom_id1] != !discovered[atom_id2]) {
+                backtrack.weights[discovered[atom_id1] ? atom_id2 : atom_id1]++;
+            }
+        }
+        queue_count = -1;
+    }
+    arena_release(&scratch, mark);
+    return queue_count;
+}
+
+// Every undecided bond adds its order to both of its atoms, so within each
+// component of the undecided bonds the residual valences have to sum up to
+// an even number between twice the smallest and twice the largest possible
+// orders of these bonds. Local propagation cannot see this, and without it
+// the search drowns in puzzles with an odd total valence.
+int backtrack_balanced(unsigned char* domains) {
+    ArenaMark mark = arena_mark(&scratch);
+    unsigned* residuals = arena_alloc(&scratch, atoms_count*sizeof(unsigned));
+    int* queue = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int result = 1;
+    for(int i = 0; i < atoms_count && result; i++) {
+        Link* link = &backtrack.links[i];
+        int decided = 0;
+        for(int j = 0; j < link->count; j++) {
+            unsigned char domain = domains[link->bond_ids[j]];
+            if(__builtin_popcount(domain) == 1) decided += __builtin_ctz(domain);
+        }
+        residuals[i] = backtrack.valences[i] >> decided;
+        if(!residuals[i]) result = 0;
+        atoms[i].mark = 0;
+    }
+    for(int root = 0; root < atoms_count && result; root++) {
+        if(atoms[root].mark) continue;
+        atoms[root].mark = 1;
+        queue[0] = root;
+        int queue_count = 1;
+        // Bit p of parities is set if the residuals can sum up to parity p.
+        unsigned parities = 1;
+        int low = 0, high = 0, bonds_low = 0, bonds_high = 0;
+        for(int q = 0; q < queue_count; q++) {
+            int atom_id = queue[q];
+            unsigned residual = residuals[atom_id];
+            unsigned atom_parities = ((residual & 0x155) ? 1 : 0) | ((residual & 0xaa) ? 2 : 0);
+            parities = ((parities & 1) ? atom_parities : 0) | ((parities & 2) ? ((atom_parities << 1) | (atom_parities >> 1)) & 3 : 0);
+            low += __builtin_ctz(residual);
+            high += 31 - __builtin_clz(residual);
+            Link* link = &backtrack.links[atom_id];
+            for(int i = 0; i < link->count; i++) {
+                unsigned char domain = domains[link->bond_ids[i]];
+                if(__builtin_popcount(domain) == 1) continue;
+                // Each undecided bond is seen from both of its atoms.
+                bonds_low += __builtin_ctz(domain);
+                bonds_high += 31 - __builtin_clz(domain);
+                int other = link->atom_ids[i];
+                if(!atoms[other].mark) {
+                    atoms[other].mark = 1;
+                    queue[queue_count++] = other;
+                }
+            }
+        }
+        if(!(parities & 1) || high < bonds_low || bonds_high < low) result = 0;
+    }
+    arena_release(&scratch, mark);
+    return result;
+}
+
+// Max flow by Dinic's algorithm on a network rebuilt for every check. Edge
+// i and i^1 are the two directions of one arc.
+typedef struct {
+    int* heads;
+    int* levels;
+    int* iterators;
+    int* queue;
+    int* path;
+    int* nexts;
+    int* tos;
+    int* capacities;
+    int edges_count;
+    int nodes_count;
+} Flow;
+
+_Thread_local Flow flow;
+
+// Allocates a network for the atoms and bonds of the puzzle from scratch.
+void flow_init(void) {
+    int nodes_count = atoms_count + 4;
+    int edges_count = 2*(bonds_count + 2*atoms_count + 3);
+    flow.heads = arena_alloc(&scratch, nodes_count*sizeof(int));
+    flow.levels = arena_alloc(&scratch, nodes_count*sizeof(int));
+    flow.iterators = arena_alloc(&scratch, nodes_count*sizeof(int));
+    flow.queue = arena_alloc(&scratch, nodes_count*sizeof(int));
+    flow.path = arena_alloc(&scratch, nodes_count*sizeof(int));
+    flow.nexts = arena_alloc(&scratch, edges_count*sizeof(int));
+    flow.tos = arena_alloc(&scratch, edges_count*sizeof(int));
+    flow.capacities = arena_alloc(&scratch, edges_count*sizeof(int));
+}
+
+void flow_reset(int nodes_count) {
+    flow.nodes_count = nodes_count;
+    flow.edges_count = 0;
+    for(int i = 0; i < nodes_count; i++) {
+        flow.heads[i] = -1;
+    }
+}
+
+void flow_add(int from, int to, int capacity) {
+    int e = flow.edges_count;
+    flow.tos[e] = to;
+    flow.capacities[e] = capacity;
+    flow.nexts[e] = flow.heads[from];
+    flow.heads[from] = e;
+    flow.tos[e + 1] = from;
+    flow.capacities[e + 1] = 0;
+    flow.nexts[e + 1] = flow.heads[to];
+    flow.heads[to] = e + 1;
+    flow.edges_count += 2;
+}
+
+int flow_levels(int source, int sink) {
+    int* queue = flow.queue;
+    for(int i = 0; i < flow.nodes_count; i++) {
+        flow.levels[i] = -1;
+    }
+    flow.levels[source] = 0;
+    queue[0] = source;
+    int queue_count = 1;
+    for(int q = 0; q < queue_count; q++) {
+        int v = queue[q];
+        for(int e = flow.heads[v]; e >= 0; e = flow.nexts[e]) {
+            if(flow.capacities[e] > 0 && flow.levels[flow.tos[e]] < 0) {
+                flow.levels[flow.tos[e]] = flow.levels[v] + 1;
+                queue[queue_count++] = flow.tos[e];
+            }
+        }
+    }
+    return flow.levels[sink] >= 0;
+}
+
+// Pushes flow along one path of the level graph. The path is grown edge by
+// edge, and a dead end is cut off the level graph before retreating.
+int flow_push(int source, int sink) {
+    int path_count = 0;
+    int v = source;
+    while(v != sink) {
+        int* e = &flow.iterators[v];
+        while(*e >= 0 && (flow.capacities[*e] <= 0 || flow.levels[flow.tos[*e]] != flow.levels[v] + 1)) {
+            *e = flow.nexts[*e];
+        }
+        if(*e >= 0) {
+            flow.path[path_count++] = *e;
+            v = flow.tos[*e];
+        } else {
+            flow.levels[v] = -1;
+            if(path_count == 0) return 0;
+            v = flow.tos[flow.path[--path_count] ^ 1];
+        }
+    }
+    int amount = INT32_MAX;
+    for(int i = 0; i < path_count; i++) {
+        amount = min(amount, flow.capacities[flow.path[i]]);
+    }
+    for(int i = 0; i < path_count; i++) {
+        flow.capacities[flow.path[i]] -= amount;
+        flow.capacities[flow.path[i] ^ 1] += amount;
+    }
+    return amount;
+}
+
+int flow_max(int source, int sink) {
+    int total = 0;
+    while(flow_levels(source, sink)) {
+        for(int i = 0; i < flow.nodes_count; i++) {
+            flow.iterators[i] = flow.heads[i];
+        }
+        int pushed;
+        while((pushed = flow_push(source, sink)) > 0) {
+            total += pushed;
+        }
+    }
+    return total;
+}
+
+// On a bipartite template the valence rules alone are a flow problem: bond
+// orders flow from the atoms of one side to the atoms of the other, each
+// atom passing on as much as its valence allows. Order ranges and valence
+// ranges become lower and upper bounds, which are removed the usual way by
+// a second source and sink. This finds the parity and counting arguments
+// which defeat local propagation, and decides the valence part exactly.
+int backtrack_flow(unsigned char* domains) {
+    int source = atoms_count, sink = atoms_count + 1;
+    int bounded_source = atoms_count + 2, bounded_sink = atoms_count + 3;
+    ArenaMark mark = arena_mark(&scratch);
+    int* excess = arena_alloc(&scratch, (atoms_count + 2)*sizeof(int));
+    memset(excess, 0, (atoms_count + 2)*sizeof(int));
+    flow_reset(atoms_count + 4);
+    for(int i = 0; i < atoms_count + bonds_count; i++) {
+        int from, to, low, high;
+        if(i < atoms_count) {
+            int side = backtrack.sides[i];
+            from = side ? i : source;
+            to = side ? sink : i;
+            low = __builtin_ctz(backtrack.valences[i]);
+            high = 31 - __builtin_clz(backtrack.valences[i]);
+        } else {
+            Bond* bond = &bonds[i - atoms_count];
+            if(bond->atom_id1 < 0 || bond->atom_id2 < 0) continue;
+            int first = backtrack.sides[bond->atom_id1] == 0;
+            from = first ? bond->atom_id1 : bond->atom_id2;
+            to = first ? bond->atom_id2 : bond->atom_id1;
+            low = __builtin_ctz(domains[i - atoms_count]);
+            high = 31 - __builtin_clz(domains[i - atoms_count]);
+        }
+        if(high > low) flow_add(from, to, high - low);
+        excess[to] += low;
+        excess[from] -= low;
+    }
+    flow_add(sink, source, INT32_MAX);
+    int required = 0;
+    for(int i = 0; i < atoms_count + 2; i++) {
+        if(excess[i] > 0) {
+            flow_add(bounded_source, i, excess[i]);
+            required += excess[i];
+        } else if(excess[i] < 0) {
+            flow_add(i, bounded_sink, -excess[i]);
+        }
+    }
+    arena_release(&scratch, mark);
+    return flow_max(bounded_source, bounded_sink) == required;
+}
+
+// Alternates propagation along the links and connectivity pruning until
+// neither narrows a domain any more, starting with the atoms in queue.
+// Returns 0 if the puzzle has no solution with these domains.
+int backtrack_narrow(unsigned char* domains, int* queue, int queue_count) {
+    while(queue_count > 0) {
+        if(!backtrack_propagate(domains, queue, queue_count)) return 0;
+        queue_count = backtrack_connect(domains, queue);
+        if(queue_count < 0) return 0;
+    }
+    return backtrack.bipartite ? backtrack_flow(domains) : backtrack_balanced(domains);
+}
+
+// Picks the undecided bond with the largest ratio of failures at its atoms
+// to orders left (dom/wdeg), so the search keeps working on the part of the
+// puzzle which is hardest to satisfy. Returns -1 if all bonds are decided.
+int backtrack_branch(unsigned char* domains) {
+    int branch = -1;
+    int branch_weight = 0;
+    int branch_count = 1;
+    for(int i = 0; i < bonds_count; i++) {
+        int count = __builtin_popcount(domains[i]);
+        if(count <= 1) continue;
+        int weight = 1 + backtrack.weights[bonds[i].atom_id1] + backtrack.weights[bonds[i].atom_id2];
+        if(branch < 0 || weight*branch_count > branch_weight*count) {
+            branch = i;
+            branch_weight = weight;
+            branch_count = count;
+        }
+    }
+    return branch;
+}
+
+// Depth first search without recursion. Level d of the search decides the
+// bond branches[d], tries its orders from orders[d] on and undoes the trail
+// down to marks[d] before each of them.
+void backtrack_search(unsigned char* domains) {
+    ArenaMark mark = arena_mark(&scratch);
+    int* branches = arena_alloc(&scratch, (bonds_count + 1)*sizeof(int));
+    int* orders = arena_alloc(&scratch, (bonds_count + 1)*sizeof(int));
+    int* marks = arena_alloc(&scratch, (bonds_count + 1)*sizeof(int));
+    int depth = 0;
+    branches[0] = backtrack_branch(domains);
+    orders[0] = 0;
+    marks[0] = backtrack.trail_count;
+    while(depth >= 0 && backtrack.solutions_count < backtrack.max_solutions) {
+        int branch = branches[depth];
+        if(branch < 0) {
+            if(backtrack.solutions_count == 0) backtrack.num_decisions = backtrack.decisions;
+            backtrack.solutions_count++;
+            for(int i = 0; i < bonds_count; i++) {
+                bonds[i].alternative = bonds[i].solution;
+                bonds[i].solution = __builtin_ctz(domains[i]);
+            }
+            depth--;
+            continue;
+        }
+        backtrack_undo(domains, marks[depth]);
+        int order = orders[depth]++;
+        if(order > 3) {
+            depth--;
+            continue;
+        }
+        if(!(domains[branch] & (1 << order))) continue;
+        backtrack.decisions++;
+        backtrack_set(domains, branch, 1 << order);
+        backtrack.queue[0] = bonds[branch].atom_id1;
+        backtrack.queue[1] = bonds[branch].atom_id2;
+        if(!backtrack_narrow(domains, backtrack.queue, 2)) continue;
+        depth++;
+        branches[depth] = backtrack_branch(domains);
+        orders[depth] = 0;
+        marks[depth] = backtrack.trail_count;
+    }
+    arena_release(&scratch, mark);
+}
+
+// Colours the atoms with sides 0 and 1 such that every bond joins both
+// sides, if the template allows it. Returns whether it does.
+int label_sides(int* sides) {
+    int bipartite = 1;
+    for(int i = 0; i < atoms_count; i++) {
+        sides[i] = -1;
+    }
+    ArenaMark mark = arena_mark(&scratch);
+    int* stack = arena_alloc(&scratch, atoms_count*sizeof(int));
+    for(int root = 0; root < atoms_count; root++) {
+        if(sides[root] >= 0) continue;
+        sides[root] = 0;
+        stack[0] = root;
+        int stack_count = 1;
+        while(stack_count > 0) {
+            int atom_id = stack[--stack_count];
+            Link link = get_atom_link(atom_id);
+            for(int i = 0; i < link.count; i++) {
+                int other = link.atom_ids[i];
+                if(sides[other] < 0) {
+                    sides[other] = !sides[atom_id];
+                    stack[stack_count++] = other;
+                } else if(sides[other] == sides[atom_id]) {
+                    bipartite = 0;
+                }
+            }
+        }
+    }
+    arena_release(&scratch, mark);
+    return bipartite;
+}
+
+// Counts the solutions of the current puzzle up to max_solutions without
+// picosat. The last solution found is left in bonds[].solution.
+SolveValue backtrack_solve(int max_solutions) {
+    double start = seconds();
+    backtrack.max_solutions = max_solutions;
+    backtrack.solutions_count = 0;
+    backtrack.num_decisions = 0;
+    backtrack.decisions = 0;
+
+    ArenaMark mark = arena_mark(&scratch);
+    backtrack.links = arena_alloc(&scratch, atoms_count*sizeof(Link));
+    backtrack.valences = arena_alloc(&scratch, atoms_count*sizeof(unsigned));
+    backtrack.weights = arena_alloc(&scratch, atoms_count*sizeof(int));
+    backtrack.sides = arena_alloc(&scratch, atoms_count*sizeof(int));
+    backtrack.queue = arena_alloc(&scratch, 2*atoms_count*sizeof(int));
+    backtrack.trail = arena_alloc(&scratch, 3*bonds_count*sizeof(BacktrackChange));
+    backtrack.trail_count = 0;
+    flow_init();
+
+    int* queue = backtrack.queue;
+    for(int i = 0; i < atoms_count; i++) {
+        backtrack.links[i] = get_atom_link(i);
+        backtrack.weights[i] = 0;
+        // The search finds no core.
+        atoms[i].failed = 0;
+        backtrack.valences[i] = atoms[i].kind != ATOM_UNSPECIFIED ? 1u << atoms[i].kind : 0x1f;
+        queue[i] = i;
+    }
+    // A bond with a missing end cannot take part in the solution.
+    unsigned char* domains = arena_alloc(&scratch, bonds_count);
+    for(int i = 0; i < bonds_count; i++) {
+        domains[i] = bonds[i].atom_id1 < 0 || bonds[i].atom_id2 < 0 ? 1 : 0xf;
+    }
+
+    // Hexagonal templates are bipartite, which allows backtrack_flow().
+    backtrack.bipartite = label_sides(backtrack.sides);
+
+    if(atoms_count > 0 && backtrack_narrow(domains, queue, atoms_count)) {
+        backtrack_search(domains);
+    }
+    arena_release(&scratch, mark);
+    stats.decisions += backtrack.decisions;
+    stats_solved(start);
+    return (SolveValue) {
+        .num_solutions = backtrack.solutions_count,
+        .num_decisions = backtrack.num_decisions,
+    };
+}
+
+// --engine frontier counts the solutions by dynamic programming over the
+// bonds, swept row by row. After each bond the frontier holds the atoms
+// with bonds on both sides of the sweep. A state records, for every
+// frontier atom, the sum of its decided bond orders and the component it
+// belongs to in the decided bonds, labelled in order of first occurrence.
+// Partial solutions with the same state complete in the same ways, so
+// each state only keeps how many partial solutions reach it, capped at
+// max_solutions. An atom leaves the frontier after its last bond with its
+// valence met, and its component must either live on in another frontier
+// atom or be the whole molecule. The templates are about as wide as they
+// are tall, so the frontier reaches 8 to 10 atoms, and the number of
+// states grows with it.
+//
+// To recover the solutions every state keeps some of the transitions into
+// it, enough to reach max_solutions, which are followed backwards from
+// the final state.
+//
+// Long frontiers and atoms of unspecified kind can blow up the number of
+// states. Once a layer has more than FRONTIER_MAX_STATES, the puzzle is
+// handed to picosat instead.
+#define FRONTIER_MAX_STATES (1 << 12)
+
+typedef struct {
+    int pred;
+    int next;
+    int order;
+} FrontierEdge;
+
+typedef struct {
+    // The states of the current and of the next layer, 2*width bytes each:
+    // the sums and then the labels.
+    unsigned char* states[2];
+    size_t states_capacity[2];
+    // Count and first kept transition of every state of every layer.
+    int* counts;
+    int* heads;
+    int capacity;
+    FrontierEdge* edges;
+    int edges_count;
+    int edges_capacity;
+    // Hash table of the next layer, indices into states[1].
+    int* table;
+    int table_capacity;
+} Frontier;
+
+_Thread_local Frontier frontier;
+
+void frontier_free(void) {
+    free(frontier.states[0]);
+    free(frontier.states[1]);
+    free(frontier.counts);
+    free(frontier.heads);
+    free(frontier.edges);
+    free(frontier.table);
+    frontier = (Frontier) {};
+}
+
+int frontier_compare_bonds(const void* a, const void* b) {
+    const Bond* ba = &bonds[*(const int*) a];
+    const Bond* bb = &bonds[*(const int*) b];
+    if(ba->y != bb->y) return ba->y - bb->y;
+    return ba->x - bb->x;
+}
+
+// Adds the state to the next layer, which has states_count states starting
+// at global index base, or adds count to it if it is there already.
+void frontier_insert(unsigned char* state, int width, int* states_count, int base, int pred, int order, int count, int max_solutions) {
+    int bytes = 2*width;
+    unsigned hash = 2166136261u;
+    for(int i = 0; i < bytes; i++) hash = (hash ^ state[i]) * 16777619u;
+    if(2*(*states_count + 1) > frontier.table_capacity) {
+        free(frontier.table);
+        frontier.table_capacity = max(2*frontier.table_capacity, 1024);
+        frontier.table = malloc(frontier.table_capacity*sizeof(int));
+        memset(frontier.table, -1, frontier.table_capacity*sizeof(int));
+        for(int i = 0; i < *states_count; i++) {
+            unsigned h = 2166136261u;
+            for(int j = 0; j < bytes; j++) h = (h ^ frontier.states[1][i*bytes + j]) * 16777619u;
+            int slot = h & (frontier.table_capacity - 1);
+            while(frontier.table[slot] >= 0) slot = (slot + 1) & (frontier.table_capacity - 1);
+            frontier.table[slot] = i;
+        }
+    }
+    int slot = hash & (frontier.table_capacity - 1);
+    while(frontier.table[slot] >= 0 && memcmp(frontier.states[1] + frontier.table[slot]*bytes, state, bytes) != 0) {
+        slot = (slot + 1) & (frontier.table_capacity - 1);
+    }
+    int index = frontier.table[slot];
+    if(index < 0) {
+        index = (*states_count)++;
+        frontier.table[slot] = index;
+        if((size_t) (index + 1)*bytes > frontier.states_capacity[1]) {
+            frontier.states_capacity[1] = max(2*frontier.states_capacity[1], (size_t) (index + 1)*bytes);
+            frontier.states[1] = realloc(frontier.states[1], frontier.states_capacity[1]);
+        }
+        memcpy(frontier.states[1] + index*bytes, state, bytes);
+        if(base + index + 1 > frontier.capacity) {
+            frontier.capacity = max(2*frontier.capacity, base + index + 1);
+            frontier.counts = realloc(frontier.counts, frontier.capacity*sizeof(int));
+            frontier.heads = realloc(frontier.heads, frontier.capacity*sizeof(int));
+        }
+        frontier.counts[base + index] = 0;
+        frontier.heads[base + index] = -1;
+    }
+    if(frontier.counts[base + index] >= max_solutions) return;
+    frontier.counts[base + index] = min(frontier.counts[base + index] + count, max_solutions);
+    if(frontier.edges_count == frontier.edges_capacity) {
+        frontier.edges_capacity = max(2*frontier.edges_capacity, 1024);
+        frontier.edges = realloc(frontier.edges, frontier.edges_capacity*sizeof(FrontierEdge));
+    }
+    frontier.edges[frontier.edges_count] = (FrontierEdge) { pred, frontier.heads[base + index], order };
+    frontier.heads[base + index] = frontier.edges_count++;
+}
+
+SolveValue frontier_solve(int max_solutions) {
+    double start = seconds();
+    ArenaMark mark = arena_mark(&scratch);
+    unsigned* valences = arena_alloc(&scratch, atoms_count*sizeof(unsigned));
+    int* firsts = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* lasts = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* lefts = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* positions = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* frontier_atom_ids = arena_alloc(&scratch, atoms_count*sizeof(int));
+    for(int i = 0; i < atoms_count; i++) {
+        // The dynamic program finds no core.
+        atoms[i].failed = 0;
+        valences[i] = atoms[i].kind != ATOM_UNSPECIFIED ? 1u << atoms[i].kind : 0x1f;
+        firsts[i] = -1;
+        lefts[i] = 0;
+    }
+    // A bond with a missing end cannot take part in the solution.
+    int* bond_ids = arena_alloc(&scratch, bonds_count*sizeof(int));
+    int steps = 0;
+    for(int i = 0; i < bonds_count; i++) {
+        if(bonds[i].atom_id1 >= 0 && bonds[i].atom_id2 >= 0) bond_ids[steps++] = i;
+        else bonds[i].solution = 0;
+    }
+    qsort(bond_ids, steps, sizeof(int), frontier_compare_bonds);
+    int last_first = -1;
+    for(int k = 0; k < steps; k++) {
+        int ends[2] = { bonds[bond_ids[k]].atom_id1, bonds[bond_ids[k]].atom_id2 };
+        for(int j = 0; j < 2; j++) {
+            if(firsts[ends[j]] < 0) firsts[ends[j]] = last_first = k;
+            lasts[ends[j]] = k;
+            lefts[ends[j]]++;
+        }
+    }
+
+    // An atom without bonds is a solution on its own at most.
+    int isolated = 0;
+    for(int i = 0; i < atoms_count; i++) {
+        if(firsts[i] < 0) isolated = 1;
+    }
+    int solutions_count = 0;
+    if(isolated || steps == 0) {
+        solutions_count = atoms_count == 1 && (valences[0] & 1) ? 1 : 0;
+        steps = 0;
+    }
+
+    // On a bipartite template the bonds still to decide must add as much
+    // valence on one side as on the other (see core_rebalance()). The
+    // atoms which enter after bond k need between futures_low[k] and
+    // futures_high[k] more on the first side than on the second.
+    int* signs = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int* futures_low = arena_alloc(&scratch, (steps + 1)*sizeof(int));
+    int* futures_high = arena_alloc(&scratch, (steps + 1)*sizeof(int));
+    int bipartite = label_sides(signs);
+    for(int k = 0; k <= steps; k++) futures_low[k] = futures_high[k] = 0;
+    for(int i = 0; i < atoms_count; i++) {
+        signs[i] = bipartite ? 1 - 2*signs[i] : 0;
+        if(firsts[i] <= 0) continue;
+        int low = signs[i]*__builtin_ctz(valences[i]);
+        int high = signs[i]*(31 - __builtin_clz(valences[i]));
+        futures_low[firsts[i] - 1] += min(low, high);
+        futures_high[firsts[i] - 1] += max(low, high);
+    }
+    for(int k = steps - 1; k > 0; k--) {
+        futures_low[k - 1] += futures_low[k];
+        futures_high[k - 1] += futures_high[k];
+    }
+
+    // Layer k holds the states after k bonds, starting at layer_starts[k].
+    int* layer_starts = arena_alloc(&scratch, (steps + 2)*sizeof(int));
+    unsigned char* state = arena_alloc(&scratch, atoms_count);
+    unsigned char* out = arena_alloc(&scratch, 2*atoms_count);
+    int* labels = arena_alloc(&scratch, atoms_count*sizeof(int));
+    unsigned char* map = arena_alloc(&scratch, atoms_count);
+    char* leaving = arena_alloc(&scratch, atoms_count);
+    char* growing = arena_alloc(&scratch, atoms_count);
+    int* next_atom_ids = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int width = 0;
+    int states_count = steps > 0 ? 1 : 0;
+    frontier.edges_count = 0;
+    if(steps > 0) {
+        if(frontier.capacity == 0) {
+            frontier.capacity = 1024;
+            frontier.counts = malloc(frontier.capacity*sizeof(int));
+            frontier.heads = malloc(frontier.capacity*sizeof(int));
+            for(int i = 0; i < 2; i++) {
+                frontier.states_capacity[i] = 1024;
+                frontier.states[i] = malloc(frontier.states_capacity[i]);
+            }
+        }
+        frontier.counts[0] = 1;
+        frontier.heads[0] = -1;
+        layer_starts[0] = 0;
+        layer_starts[1] = 1;
+    }
+    for(int k = 0; k < steps && states_count > 0; k++) {
+        int bond_id = bond_ids[k];
+        int u = bonds[bond_id].atom_id1;
+        int v = bonds[bond_id].atom_id2;
+        int base = layer_starts[k];
+        int next_base = layer_starts[k + 1];
+        // The atoms of this bond enter the frontier at its end, with a
+        // component of their own.
+        int entered_width = width;
+        if(firsts[u] == k) frontier_atom_ids[positions[u] = entered_width++] = u;
+        if(firsts[v] == k) frontier_atom_ids[positions[v] = entered_width++] = v;
+        lefts[u]--;
+        lefts[v]--;
+        int pu = positions[u];
+        int pv = positions[v];
+        // Then the atoms whose last bond this is leave it.
+        int next_width = 0;
+        for(int i = 0; i < entered_width; i++) {
+            leaving[i] = lasts[frontier_atom_ids[i]] == k;
+            if(!leaving[i]) next_atom_ids[next_width++] = frontier_atom_ids[i];
+        }
+        int done = k >= last_first && next_width == 0;
+
+        if(frontier.table_capacity > 0) memset(frontier.table, -1, frontier.table_capacity*sizeof(int));
+        int next_count = 0;
+        for(int s = 0; s < states_count && next_count <= FRONTIER_MAX_STATES; s++) {
+            unsigned char* sums = frontier.states[0] + 2*width*s;
+            unsigned char* old_labels = sums + width;
+            for(int order = 0; order <= 3; order++) {
+                unsigned char* next = state;
+                // next holds the sums of the frontier with the entering atoms.
+                for(int i = 0; i < width; i++) {
+                    next[i] = sums[i];
+                    labels[i] = old_labels[i];
+                }
+                for(int i = width; i < entered_width; i++) {
+                    next[i] = 0;
+                    labels[i] = i;
+                }
+                next[pu] += order;
+                next[pv] += order;
+                int feasible = 1;
+                int ends[2] = { u, v };
+                for(int j = 0; j < 2; j++) {
+                    int sum = next[positions[ends[j]]];
+                    unsigned valence = valences[ends[j]];
+                    // Too much already, or too little even if every bond
+                    // left gets order 3.
+                    if(sum > 31 - __builtin_clz(valence) || sum + 3*lefts[ends[j]] < __builtin_ctz(valence)) feasible = 0;
+                    if(lasts[ends[j]] == k && !(valence & (1u << sum))) feasible = 0;
+                }
+                if(!feasible) continue;
+                if(order > 0 && labels[pu] != labels[pv]) {
+                    int merged = labels[pv];
+                    for(int i = 0; i < entered_width; i++) {
+                        if(labels[i] == merged) labels[i] = labels[pu];
+                    }
+                }
+                // A component closes if all its atoms leave. Only the last
+                // component may close, once every atom has entered.
+                int closed = 0;
+                for(int j = 0; j < 2; j++) {
+                    int label = labels[positions[ends[j]]];
+                    if(lasts[ends[j]] != k || (j == 1 && lasts[u] == k && labels[pu] == label)) continue;
+                    int alive = 0;
+                    for(int i = 0; i < entered_width; i++) {
+                        if(!leaving[i] && labels[i] == label) alive = 1;
+                    }
+                    closed += !alive;
+                }
+                if(closed > 1 || (closed == 1 && !done)) continue;
+                // Drop the leaving atoms and relabel the components in order
+                // of first occurrence.
+                memset(map, 0xff, entered_width);
+                int n = 0;
+                int labels_count = 0;
+                for(int i = 0; i < entered_width; i++) {
+                    if(leaving[i]) continue;
+                    if(map[labels[i]] == 0xff) map[labels[i]] = labels_count++;
+                    out[next_width + n] = map[labels[i]];
+                    out[n++] = next[i];
+                }
+                // A component whose atoms have all reached their valence
+                // can't grow any more, so it must be the whole molecule.
+                // And the remaining valences must balance.
+                memset(growing, 0, labels_count);
+                int low = futures_low[k];
+                int high = futures_high[k];
+                for(int i = 0; i < next_width; i++) {
+                    int atom_id = next_atom_ids[i];
+                    int top = 31 - __builtin_clz(valences[atom_id]);
+                    if(out[i] < top) growing[out[next_width + i]] = 1;
+                    int residual_low = signs[atom_id]*max(__builtin_ctz(valences[atom_id]) - out[i], 0);
+                    int residual_high = signs[atom_id]*(top - out[i]);
+                    low += min(residual_low, residual_high);
+                    high += max(residual_low, residual_high);
+                }
+                if(low > 0 || high < 0) continue;
+                int stuck = 0;
+                for(int i = 0; i < labels_count; i++) {
+                    if(!growing[i]) stuck = 1;
+                }
+                if(stuck && (labels_count > 1 || k < last_first)) continue;
+                frontier_insert(out, next_width, &next_count, next_base, s, order, frontier.counts[base + s], max_solutions);
+            }
+        }
+        // The next layer becomes the current one, with the frontier
+        // compacted like its states.
+        int n = 0;
+        for(int i = 0; i < entered_width; i++) {
+            int atom_id = frontier_atom_ids[i];
+            if(lasts[atom_id] == k) continue;
+            positions[atom_id] = n;
+            frontier_atom_ids[n++] = atom_id;
+        }
+        width = next_width;
+        states_count = next_count;
+        if(states_count > FRONTIER_MAX_STATES) break;
+        layer_starts[k + 2] = next_base + next_count;
+        unsigned char* swap = frontier.states[0];
+        frontier.states[0] = frontier.states[1];
+        frontier.states[1] = swap;
+        size_t swap_capacity = frontier.states_capacity[0];
+        frontier.states_capacity[0] = frontier.states_capacity[1];
+        frontier.states_capacity[1] = swap_capacity;
+    }
+    if(states_count > FRONTIER_MAX_STATES) {
+        arena_release(&scratch, mark);
+        stats.solve_seconds += seconds() - start;
+        Session* session = session_create();
+        SolveValue value = session_solve(session, max_solutions);
+        session_destroy(session);
+        return value;
+    }
+    if(steps > 0 && states_count > 0) solutions_count = frontier.counts[layer_starts[steps]];
+
+    // Follows the kept transitions back from the final state. Every state
+    // is reachable from the start, so every path found is a solution.
+    // chosen[k] is the transition into the state of layer k on the path.
+    int found = 0;
+    if(steps > 0 && solutions_count > 0) {
+        int* chosen = arena_alloc(&scratch, (steps + 1)*sizeof(int));
+        int layer = steps;
+        chosen[layer] = frontier.heads[layer_starts[layer]];
+        while(layer <= steps && found < solutions_count) {
+            if(layer == 0) {
+                for(int i = 0; i < bonds_count; i++) bonds[i].alternative = bonds[i].solution;
+                for(int i = 1; i <= steps; i++) bonds[bond_ids[i - 1]].solution = frontier.edges[chosen[i]].order;
+                found++;
+                layer = 1;
+                chosen[1] = frontier.edges[chosen[1]].next;
+            } else if(chosen[layer] < 0) {
+                layer++;
+                if(layer <= steps) chosen[layer] = frontier.edges[chosen[layer]].next;
+            } else {
+                int pred = frontier.edges[chosen[layer]].pred;
+                layer--;
+                if(layer > 0) chosen[layer] = frontier.heads[layer_starts[layer] + pred];
+            }
+        }
+    }
+    assert(steps == 0 || found == solutions_count);
+    arena_release(&scratch, mark);
+    stats_solved(start);
+    return (SolveValue) {
+        .num_solutions = solutions_count,
+    };
+}
+
+// Solves the current puzzle with a solver built from scratch.
+SolveValue solve(int max_solutions) {
+    if(options.engine == ENGINE_BACKTRACK) return backtrack_solve(max_solutions);
+    if(options.engine == ENGINE_FRONTIER) return frontier_solve(max_solutions);
+    Session* session = session_create();
+    SolveValue result = session_solve(session, max_solutions);
+    session_destroy(session);
+    return result;
+}
+
+int sample_distribution(int* distribution, int length, int total) {
+    int r = random_int() % total;
+    for(int i = 0; i < length; i++) {
+        if(r < distribution[i]) {
+            return i;
+        } else {
+            r -= distribution[i];
+        }
+    }
+    assert(0);
+    return 0;
+}
+
+// With --generation molecule the generator samples bond orders instead of
+// kinds: a connected molecule on the template, whose bond sums are the
+// kinds of the atoms. So every candidate has at least this solution, and
+// the solver only has to rule out the others. The kinds start out from a
+// random spanning tree of single bonds and then change by moves along
+// paths, which keep the molecule valid.
+#define MOLECULE_SWEEPS 8
+#define MOLECULE_LOCAL_ATTEMPTS 64
+#define MOLECULE_PATH 6
+#define MOLECULE_MOVES 2
+
+typedef struct {
+    int* distribution;
+    unsigned char* orders;
+    int* seen;
+    int stamp;
+    int* queue;
+} Molecule;
+
+// Whether the other bonds of the molecule still connect the ends of bond_id.
+int molecule_connected_without(Molecule* molecule, int bond_id) {
+    int target = bonds[bond_id].atom_id2;
+    int head = 0;
+    int tail = 0;
+    molecule->stamp++;
+    molecule->queue[tail++] = bonds[bond_id].atom_id1;
+    molecule->seen[bonds[bond_id].atom_id1] = molecule->stamp;
+    while(head < tail) {
+        int atom_id = molecule->queue[head++];
+        if(atom_id == target) return 1;
+        Link link = get_atom_link(atom_id);
+        for(int i = 0; i < link.count; i++) {
+            int next = link.atom_ids[i];
+            if(link.bond_ids[i] == bond_id || molecule->orders[link.bond_ids[i]] == 0) continue;
+            if(molecule->seen[next] == molecule->stamp) continue;
+            molecule->seen[next] = molecule->stamp;
+            molecule->queue[tail++] = next;
+        }
+    }
+    return 0;
+}
+
+int molecule_on_path(int* path, int length, int bond_id) {
+    for(int i = 0; i < length; i++) {
+        if(path[i] == bond_id) return 1;
+    }
+    return 0;
+}
+
+// Walks a random path of at most MOLECULE_PATH bonds from atom_id and changes
+// their orders by +1, -1, +1, ... or the other way round, which keeps the
+// kinds of all atoms on the path but its ends. The walk stops early at an
+// atom marked in stop. The change is kept if the molecule stays connected
+// and the kinds of the ends valid and of nonzero weight. With metropolis
+// set it is then accepted by the Metropolis rule on the product of the
+// weights of the kinds of both ends, so in the long run molecules are
+// sampled in proportion to the product of the weights of all their atoms.
+// Returns the other end, or -1 if the molecule did not change.
+int molecule_move(Molecule* molecule, int atom_id, char* stop, int metropolis) {
+    int path[MOLECULE_PATH];
+    int length = 0;
+    int limit = 1 + random_int() % MOLECULE_PATH;
+    int first_delta = random_int() % 2 ? 1 : -1;
+    int delta = first_delta;
+    int end = atom_id;
+    while(length < limit && (length == 0 || !stop || !stop[end])) {
+        Link link = get_atom_link(end);
+        int chosen = -1;
+        int candidates_count = 0;
+        for(int i = 0; i < link.count; i++) {
+            int order = molecule->orders[link.bond_ids[i]] + delta;
+            if(order < 0 || order > 3 || molecule_on_path(path, length, link.bond_ids[i])) continue;
+            if(random_int() % ++candidates_count == 0) chosen = i;
+        }
+        if(chosen < 0) break;
+        path[length++] = link.bond_ids[chosen];
+        molecule->orders[link.bond_ids[chosen]] += delta;
+        end = link.atom_ids[chosen];
+        delta = -delta;
+    }
+
+    int kind1 = atoms[atom_id].kind + first_delta;
+    int kind2 = atoms[end].kind - delta;
+    int* weights = molecule->distribution;
+    int valid = length > 0 && end != atom_id;
+    valid = valid && kind1 >= ATOM_H && kind1 <= ATOM_C && kind2 >= ATOM_H && kind2 <= ATOM_C;
+    int old_weight = weights[atoms[atom_id].kind]*weights[atoms[end].kind];
+    int new_weight = valid ? weights[kind1]*weights[kind2] : 0;
+    valid = new_weight > 0 && (!metropolis || new_weight >= old_weight || random_int() % old_weight < new_weight);
+    for(int i = 0; valid && i < length; i++) {
+        if(molecule->orders[path[i]] == 0 && !molecule_connected_without(molecule, path[i])) valid = 0;
+    }
+    if(!valid) {
+        for(int i = 0; i < length; i++) molecule->orders[path[i]] -= i % 2 ? -first_delta : first_delta;
+        return -1;
+    }
+    atoms[atom_id].kind = kind1;
+    atoms[end].kind = kind2;
+    return end;
+}
+
+// Grows a random spanning tree of single bonds from a random atom, adding
+// a random bond of its frontier at a time, and mixes it with MOLECULE_SWEEPS
+// moves per atom.
+void molecule_sample(Molecule* molecule) {
+    memset(molecule->orders, 0, bonds_count);
+    for(int i = 0; i < atoms_count; i++) atoms[i].kind = ATOM_UNSPECIFIED;
+    unspecified_atoms_count = 0;
+    if(atoms_count == 0 || bonds_count == 0) return;
+
+    ArenaMark mark = arena_mark(&scratch);
+    int* frontier = arena_alloc(&scratch, 2*bonds_count*sizeof(int));
+    int frontier_count = 0;
+    molecule->stamp++;
+    int atom_id = random_int() % atoms_count;
+    while(atom_id >= 0) {
+        molecule->seen[atom_id] = molecule->stamp;
+        Link link = get_atom_link(atom_id);
+        for(int i = 0; i < link.count; i++) {
+            if(molecule->seen[link.atom_ids[i]] != molecule->stamp) frontier[frontier_count++] = link.bond_ids[i];
+        }
+        atom_id = -1;
+        while(atom_id < 0 && frontier_count > 0) {
+            int i = random_int() % frontier_count;
+            int bond_id = frontier[i];
+            frontier[i] = frontier[--frontier_count];
+            Bond* b = &bonds[bond_id];
+            int from = molecule->seen[b->atom_id1] == molecule->stamp ? b->atom_id1 : b->atom_id2;
+            int to = from == b->atom_id1 ? b->atom_id2 : b->atom_id1;
+            if(molecule->seen[to] == molecule->stamp || atoms[from].kind == ATOM_C) continue;
+            molecule->orders[bond_id] = 1;
+            atoms[from].kind++;
+            atoms[to].kind++;
+            atom_id = to;
+        }
+    }
+    arena_release(&scratch, mark);
+
+    for(int i = 0; i < MOLECULE_SWEEPS*atoms_count; i++) {
+        molecule_move(molecule, random_int() % atoms_count, NULL, 1);
+    }
+}
+
+typedef struct {
+    int iterations;
+    int unique;
+} GenerateValue;
+
+volatile sig_atomic_t interrupted = 0;
+
+// With --threads the generator runs several independent chains, each in a
+// thread of its own with its own copy of the puzzle, solver and random
+// stream. A chain which finds a unique puzzle after n solves posts
+// n*threads + id to best unless a smaller value is there already, and the
+// others stop once they are past it. The winner is the chain with the
+// fewest solves and among those the lowest id, independent of timing.
+// Chains trade their connectivity clauses through pool, whose entries are
+// the id of the publishing chain, the number of literals and the literals:
+// with --share-cuts after every step, otherwise only when they stop.
+typedef struct {
+    pthread_mutex_t mutex;
+    atomic_llong best;
+    int* pool;
+    int pool_count;
+    int pool_capacity;
+} Chains;
+
+Chains chains = { .mutex = PTHREAD_MUTEX_INITIALIZER, .best = LLONG_MAX };
+
+int chains_winner(void) {
+    long long best = atomic_load(&chains.best);
+    return best == LLONG_MAX ? -1 : (int) (best % options.threads);
+}
+
+_Thread_local int chain_id = -1;
+_Thread_local int chain_pool_read = 0;
+_Thread_local int chain_published_id = 0;
+
+// Adds the clauses this chain found since the last exchange to the pool.
+// Called with the mutex held.
+void chains_publish_locked(void) {
+    for(int i = cut_set_find(chain_published_id); i < cut_set.clauses_count; i++) {
+        CutClause* clause = &cut_set.clauses[i];
+        if(clause->count == 0) continue;
+        if(chains.pool_count + 2 + clause->count > chains.pool_capacity) {
+            chains.pool_capacity = max(2*chains.pool_capacity, chains.pool_count + 2 + clause->count + 1024);
+            chains.pool = realloc(chains.pool, chains.pool_capacity*sizeof(int));
+        }
+        chains.pool[chains.pool_count++] = chain_id;
+        chains.pool[chains.pool_count++] = clause->count;
+        memcpy(chains.pool + chains.pool_count, cut_set.lits + clause->offset, clause->count*sizeof(int));
+        chains.pool_count += clause->count;
+    }
+}
+
+// Publishes the clauses this chain found since the last exchange without
+// taking any from the other chains.
+void chains_publish_cuts(void) {
+    pthread_mutex_lock(&chains.mutex);
+    chains_publish_locked();
+    pthread_mutex_unlock(&chains.mutex);
+    chain_published_id = cut_set.next_id;
+}
+
+// Publishes the clauses this chain found since the last exchange, and adds
+// the ones the other chains published in the meantime to its cut set.
+void chains_exchange_cuts(void) {
+    pthread_mutex_lock(&chains.mutex);
+    chains_publish_locked();
+    // The pool may move once the lock is dropped, so new entries are copied.
+    int count = chains.pool_count - chain_pool_read;
+    ArenaMark mark = arena_mark(&scratch);
+    int* entries = arena_alloc(&scratch, count*sizeof(int));
+    memcpy(entries, chains.pool + chain_pool_read, count*sizeof(int));
+    chain_pool_read = chains.pool_count;
+    pthread_mutex_unlock(&chains.mutex);
+
+    for(int i = 0; i < count; i += 2 + entries[i + 1]) {
+        if(entries[i] != chain_id) add_to_cut_set(entries + i + 2, entries[i + 1]);
+    }
+    arena_release(&scratch, mark);
+    chain_published_id = cut_set.next_id;
+}
+
+void interrupt_handler(int signal) {
+    (void) signal;
+    interrupted = 1;
+}
+
+// With --portfolio a solve races several differently configured SAT
+// solvers against each other, each kept alive in a member thread with its
+// own copy of the puzzle. For every solve the calling thread hands the
+// current kinds to all members and waits until they are done. The first
+// member to finish claims the result in winner, and picosat interrupts the
+// others through portfolio_interrupted. Members trade their connectivity
+// clauses through the pool of chains.
+typedef struct {
+    char* name;
+    int phase;
+    unsigned restart_interval;
+} PortfolioConfig;
+
+PortfolioConfig portfolio_configs[] = {
+    { "random",      3, 100 },
+    { "jw",          2, 100 },
+    { "false-fast",  0, 30 },
+    { "random-slow", 3, 500 },
+    { "true",        1, 100 },
+    { "jw-fast",     2, 30 },
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int members_count;
+    pthread_t* threads;
+    char* puzzle;
+    int len;
+    size_t cut_set_max_bytes;
+    // The current solve, published under mutex.
+    int round;
+    int finished;
+    int quit;
+    int max_solutions;
+    AtomKind* kinds;
+    // Set by the member which claims the result.
+    atomic_int winner;
+    SolveValue value;
+    // The solution and the alternative of every bond, and the core.
+    int* solutions;
+    char* failed;
+    Stats stats;
+    long long* wins;
+} Portfolio;
+
+Portfolio portfolio = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .winner = -1,
+};
+
+int portfolio_interrupted(void* state) {
+    (void) state;
+    return atomic_load(&portfolio.winner) >= 0 || interrupted;
+}
+
+void* portfolio_run(void* arg) {
+    int member = (int) (intptr_t) arg;
+    PortfolioConfig* config = &portfolio_configs[member % array_length(portfolio_configs)];
+    chain_id = member;
+    cut_set.max_bytes = portfolio.cut_set_max_bytes;
+    parse(portfolio.puzzle, portfolio.len);
+    if(options.cache_directory) cut_cache_load(options.cache_directory);
+    chain_published_id = cut_set.next_id;
+    random_stream = random_split(random_seed, UINT64_MAX - member);
+    Session* session = session_create();
+    picosat_set_global_default_phase(session->ps, config->phase);
+    picosat_set_restart_interval(session->ps, config->restart_interval);
+    picosat_set_interrupt(session->ps, NULL, portfolio_interrupted);
+
+    int round = 0;
+    pthread_mutex_lock(&portfolio.mutex);
+    for(;;) {
+        while(portfolio.round == round && !portfolio.quit) pthread_cond_wait(&portfolio.start, &portfolio.mutex);
+        if(portfolio.quit) break;
+        round = portfolio.round;
+        for(int i = 0; i < atoms_count; i++) atoms[i].kind = portfolio.kinds[i];
+        int max_solutions = portfolio.max_solutions;
+        pthread_mutex_unlock(&portfolio.mutex);
+
+        chains_exchange_cuts();
+        Stats total = stats;
+        stats = (Stats) {};
+        SolveValue value = session_solve(session, max_solutions);
+        Stats solve_stats = stats;
+        stats_add(&total, &solve_stats);
+        stats = total;
+        // Members are only interrupted once the result is claimed, so the
+        // claiming member always ran to completion.
+        int expected = -1;
+        if(atomic_compare_exchange_strong(&portfolio.winner, &expected, member)) {
+            portfolio.value = value;
+            for(int i = 0; i < bonds_count; i++) {
+                portfolio.solutions[2*i] = bonds[i].solution;
+                portfolio.solutions[2*i + 1] = bonds[i].alternative;
+            }
+            for(int i = 0; i < atoms_count; i++) portfolio.failed[i] = atoms[i].failed;
+            portfolio.stats = solve_stats;
+        }
+
+        pthread_mutex_lock(&portfolio.mutex);
+        if(++portfolio.finished == portfolio.members_count) pthread_cond_signal(&portfolio.done);
+    }
+    pthread_mutex_unlock(&portfolio.mutex);
+    chains_exchange_cuts();
+
+    session_destroy(session);
+    free(cut_set.clauses);
+    free(cut_set.lits);
+    free(cut_set.table);
+    arena_free(&puzzle_arena);
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Starts options.portfolio members on the puzzle, which the calling thread
+// has parsed as well.
+void portfolio_start(char* puzzle, int len) {
+    portfolio.members_count = options.portfolio;
+    portfolio.threads = malloc(portfolio.members_count*sizeof(pthread_t));
+    portfolio.wins = calloc(portfolio.members_count, sizeof(long long));
+    portfolio.kinds = malloc(atoms_count*sizeof(AtomKind));
+    portfolio.solutions = malloc(2*bonds_count*sizeof(int));
+    portfolio.failed = calloc(atoms_count, 1);
+    portfolio.puzzle = puzzle;
+    portfolio.len = len;
+    portfolio.cut_set_max_bytes = cut_set.max_bytes;
+    for(int i = 0; i < portfolio.members_count; i++) {
+        pthread_create(&portfolio.threads[i], NULL, portfolio_run, (void*) (intptr_t) i);
+    }
+}
+
+// Stops the members and takes over the connectivity clauses they found.
+void portfolio_stop(void) {
+    pthread_mutex_lock(&portfolio.mutex);
+    portfolio.quit = 1;
+    pthread_cond_broadcast(&portfolio.start);
+    pthread_mutex_unlock(&portfolio.mutex);
+    for(int i = 0; i < portfolio.members_count; i++) {
+        pthread_join(portfolio.threads[i], NULL);
+    }
+    chains_exchange_cuts();
+    free(chains.pool);
+    free(portfolio.threads);
+    free(portfolio.kinds);
+    free(portfolio.solutions);
+    free(portfolio.failed);
+}
+
+SolveValue portfolio_solve(int max_solutions) {
+    pthread_mutex_lock(&portfolio.mutex);
+    for(int i = 0; i < atoms_count; i++) portfolio.kinds[i] = atoms[i].kind;
+    portfolio.max_solutions = max_solutions;
+    portfolio.finished = 0;
+    atomic_store(&portfolio.winner, -1);
+    portfolio.round++;
+    pthread_cond_broadcast(&portfolio.start);
+    while(portfolio.finished < portfolio.members_count) pthread_cond_wait(&portfolio.done, &portfolio.mutex);
+    pthread_mutex_unlock(&portfolio.mutex);
+
+    int winner = atomic_load(&portfolio.winner);
+    portfolio.wins[winner]++;
+    for(int i = 0; i < bonds_count; i++) {
+        bonds[i].solution = portfolio.solutions[2*i];
+        bonds[i].alternative = portfolio.solutions[2*i + 1];
+    }
+    for(int i = 0; i < atoms_count; i++) atoms[i].failed = portfolio.failed[i];
+    stats_add(&stats, &portfolio.stats);
+    return portfolio.value;
+}
+
+void portfolio_print_wins(void) {
+    printf("portfolio wins:");
+    for(int i = 0; i < portfolio.members_count; i++) {
+        printf(" %s %lli%s", portfolio_configs[i % array_length(portfolio_configs)].name, portfolio.wins[i],
+               i + 1 < portfolio.members_count ? "," : "\n");
+    }
+}
+
+// The transposition table remembers the solve of every candidate the
+// generator has seen, so that a candidate which comes back, typically
+// after a reverted mutation drew the same kinds again, costs a lookup
+// instead of a solve. It maps the kinds of all atoms, through a Zobrist
+// hash, to the SolveValue and to what the generator reads from the solve
+// afterwards: the solution and the alternative of every bond, 4 bits per
+// bond, or the failed flag of every atom if there was no solution. It is
+// direct mapped with options.table_memory MB and every store replaces the
+// old entry of its slot. Entries are only valid within one call of
+// generate_in() (see table.epoch), so batches stay independent of the
+// order in which workers take their puzzles.
+
+typedef struct {
+    uint64_t key;
+    uint32_t epoch;
+    SolveValue value;
+    unsigned char payload[];
+} TableEntry;
+
+typedef struct {
+    unsigned char* entries;
+    size_t entry_size;
+    size_t capacity;
+    uint32_t epoch;
+} Table;
+
+_Thread_local Table table;
+
+// Depends on the template, so reset_puzzle() frees it.
+void table_free(void) {
+    free(table.entries);
+    table.entries = NULL;
+    table.capacity = 0;
+}
+
+// The Zobrist key of atom i with kind k is random_mix(i*ATOM_MAX + k), so
+// the keys need no storage.
+uint64_t table_key(int max_solutions) {
+    uint64_t key = random_mix(0x7461626c65u ^ (uint64_t) max_solutions);
+    for(int i = 0; i < atoms_count; i++) {
+        key ^= random_mix((uint64_t) i*ATOM_MAX + atoms[i].kind);
+    }
+    return key;
+}
+
+TableEntry* table_slot(uint64_t key) {
+    if(!table.entries) {
+        size_t payload_size = max((bonds_count + 1)/2, (atoms_count + 7)/8);
+        table.entry_size = (sizeof(TableEntry) + payload_size + 7) & ~(size_t) 7;
+        size_t bytes = (size_t) options.table_memory*1024*1024;
+        table.capacity = 1;
+        while(2*table.capacity*table.entry_size <= bytes) table.capacity *= 2;
+        table.entries = calloc(table.capacity, table.entry_size);
+    }
+    return (TableEntry*) (table.entries + (key & (table.capacity - 1))*table.entry_size);
+}
+
+int table_lookup(uint64_t key, SolveValue* value) {
+    TableEntry* entry = table_slot(key);
+    if(entry->epoch != table.epoch || entry->key != key) {
+        stats.table_misses++;
+        return 0;
+    }
+    stats.table_hits++;
+    *value = entry->value;
+    if(value->num_solutions > 0) {
+        for(int i = 0; i < bonds_count; i++) {
+            int bits = entry->payload[i/2] >> 4*(i%2);
+            bonds[i].solution = bits & 3;
+            bonds[i].alternative = (bits >> 2) & 3;
+        }
+    } else {
+        for(int i = 0; i < atoms_count; i++) atoms[i].failed = (entry->payload[i/8] >> (i%8)) & 1;
+    }
+    return 1;
+}
+
+void table_store(uint64_t key, SolveValue value) {
+    TableEntry* entry = table_slot(key);
+    entry->key = key;
+    entry->epoch = table.epoch;
+    entry->value = value;
+    memset(entry->payload, 0, table.entry_size - sizeof(TableEntry));
+    if(value.num_solutions > 0) {
+        for(int i = 0; i < bonds_count; i++) {
+            entry->payload[i/2] |= (bonds[i].solution | bonds[i].alternative << 2) << 4*(i%2);
+        }
+    } else {
+        for(int i = 0; i < atoms_count; i++) entry->payload[i/8] |= (atoms[i].failed != 0) << (i%8);
+    }
+}
+
+// Without --interactive the generator draws nothing on the terminal and
+// reports its progress as one line at most every PROGRESS_INTERVAL seconds,
+// to stderr or to the file given with --progress.
+#define PROGRESS_INTERVAL 1.0
+
+FILE* progress_file = NULL;
+double progress_start = 0;
+double progress_last = 0;
+
+void progress_report(int iterations, int num_solutions) {
+    double now = seconds();
+    if(now - progress_last < PROGRESS_INTERVAL) return;
+    progress_last = now;
+    fprintf(progress_file ? progress_file : stderr, "%.1fs: %i solves, %.0f solves/s, %i solutions, %i cuts, %zu KB\n",
+            now - progress_start, iterations, iterations / max(now - progress_start, 1e-9), num_solutions,
+            cut_set_live_count(), cut_set_bytes() / 1024);
+    fflush(progress_file ? progress_file : stderr);
+}
+
+// Runs the generator loop until the puzzle has a unique solution, or until
+// max_iterations solves were done if max_iterations is positive. Without a
+// session every candidate is solved from scratch. With report set the
+// progress is drawn or reported.
+#define NUM_CHOICES 2
+#define REBALANCE_ATTEMPTS 64
+
+// --search anneal replaces accepting every candidate with a solution by
+// simulated annealing on the number of solutions, counted up to ANNEAL_CAP.
+// A candidate with more solutions than the current one is accepted with
+// probability exp(-(new - old)/temperature), and the temperature cools by
+// ANNEAL_COOLING per step. The number of atoms mutated per step adapts: it
+// grows after every improvement and shrinks after every rejected candidate,
+// within NUM_CHOICES..MAX_CHOICES. Changing the kind of a single atom
+// leaves no solution on a bipartite template (see core_rebalance()).
+#define ANNEAL_CAP 4
+#define ANNEAL_TEMPERATURE 2.0
+#define ANNEAL_COOLING 0.99
+#define MAX_CHOICES 4
+
+// Restores the kinds recorded by generate_in() in reverse order.
+void generate_undo(int* atom_ids, AtomKind* kinds, int count) {
+    while(count > 0) {
+        count--;
+        atoms[atom_ids[count]].kind = kinds[count];
+        if(kinds[count] == ATOM_UNSPECIFIED) unspecified_atoms_count++;
+    }
+}
+
+// Every bond adds its order to the valence of one atom on either side of a
+// bipartite template, so a candidate has no solution unless both sides have
+// the same sum of valences. Then the core typically spans the whole
+// template and picking any of its atoms is no better than a random one.
+// Instead this picks an atom of the core, and a kind of nonzero weight for
+// it, which make the sums agree. Returns the atom, or -1 if the sums agree
+// already or no such atom was found.
+int core_rebalance(int* sides, int* core_atom_ids, int core_count, int* distribution, int distribution_length, AtomKind* kind) {
+    int imbalance = 0;
+    for(int i = 0; i < atoms_count; i++) {
+        imbalance += sides[i] ? -(int) atoms[i].kind : (int) atoms[i].kind;
+    }
+    for(int attempt = 0; imbalance != 0 && attempt < REBALANCE_ATTEMPTS; attempt++) {
+        int atom_id = core_atom_ids[random_int() % core_count];
+        int new_kind = atoms[atom_id].kind + (sides[atom_id] ? imbalance : -imbalance);
+        if(new_kind >= ATOM_H && new_kind <= ATOM_C && new_kind < distribution_length && distribution[new_kind] > 0) {
+            *kind = new_kind;
+            return atom_id;
+        }
+    }
+    return -1;
+}
+
+GenerateValue generate_in(Session* session, int* distribution, int distribution_length, int max_iterations, int report) {
+    int distribution_total = 0;
+    for(int i = 0; i < distribution_length; i++) {
+        distribution_total += distribution[i];
+    }
+
+    int atom_scale = 1; (void) atom_scale;
+
+    int iterations = 0;
+    int unique = 0;
+    int old_num_solutions = atom_scale*atoms_count;
+    if(report) progress_start = progress_last = seconds();
+    // Unless --mutation random is given, mutations pick among the atoms at
+    // the bonds in which the last two solutions differ, since changing one
+    // of them may rule out one of the solutions.
+    // Some ambiguous atoms cannot change without losing every solution, so
+    // after atoms_count candidates in a row without solution the mutations
+    // fall back to all atoms.
+    ArenaMark mark = arena_mark(&scratch);
+    int* ambiguous_atom_ids = arena_alloc(&scratch, atoms_count*sizeof(int));
+    char* ambiguous = arena_alloc(&scratch, atoms_count);
+    int ambiguous_count = 0;
+    int failures = 0;
+    // With --core-repairs a candidate without solution is not reverted right
+    // away. Up to options.core_repairs times the next mutation picks among
+    // the atoms of the core instead, since one of them has to change. Only
+    // if all these repairs fail, the mutations are undone, which undo
+    // records in order.
+    int* core_atom_ids = arena_alloc(&scratch, atoms_count*sizeof(int));
+    int core_count = 0;
+    int repairs = 0;
+    int undo_capacity = (max(options.core_repairs, 0) + 1)*MAX_CHOICES;
+    int* undo_atom_ids = arena_alloc(&scratch, undo_capacity*sizeof(int));
+    AtomKind* undo_kinds = arena_alloc(&scratch, undo_capacity*sizeof(AtomKind));
+    int undo_count = 0;
+    int* sides = NULL;
+    if(options.core_repairs > 0) {
+        sides = arena_alloc(&scratch, atoms_count*sizeof(int));
+        if(!label_sides(sides)) sides = NULL;
+    }
+    Molecule molecule = {};
+    if(options.generation == GENERATION_MOLECULE) {
+        molecule.distribution = distribution;
+        molecule.orders = arena_alloc(&scratch, bonds_count);
+        molecule.seen = arena_alloc(&scratch, atoms_count*sizeof(int));
+        molecule.queue = arena_alloc(&scratch, atoms_count*sizeof(int));
+        memset(molecule.seen, 0, atoms_count*sizeof(int));
+        molecule_sample(&molecule);
+    }
+    int anneal = options.search == SEARCH_ANNEAL;
+    int max_solutions = anneal ? ANNEAL_CAP : 2;
+    double temperature = ANNEAL_TEMPERATURE;
+    int choices_count = NUM_CHOICES;
+    table.epoch++;
+
+    while(!interrupted && (max_iterations <= 0 || iterations < max_iterations)) {
+        if(chain_id >= 0 && (long long) (iterations + 1)*options.threads + chain_id > atomic_load(&chains.best)) break;
+        if(options.share_cuts && chain_id >= 0 && options.batch_count == 0) chains_exchange_cuts();
+        AtomKind rebalanced_kind = ATOM_UNSPECIFIED;
+        int rebalanced_atom_id = -1;
+        if(core_count > 0 && sides) {
+            rebalanced_atom_id = core_rebalance(sides, core_atom_ids, core_count, distribution, distribution_length, &rebalanced_kind);
+        }
+        if(molecule.orders) {
+            // The sampled molecule itself is the first candidate. After that
+            // MOLECULE_MOVES moves change the kinds at the ends of paths,
+            // which start and if possible end at the ambiguous atoms. These
+            // moves skip the Metropolis rule, which keeps the chain among the
+            // likely molecules, and those are mostly ambiguous.
+            int moves = iterations == 0 ? MOLECULE_MOVES : 0;
+            for(int attempt = 0; moves < MOLECULE_MOVES && attempt < MOLECULE_LOCAL_ATTEMPTS + 16*atoms_count; attempt++) {
+                int local = ambiguous_count > 0 && attempt < MOLECULE_LOCAL_ATTEMPTS;
+                int atom_id = local ? ambiguous_atom_ids[random_int() % ambiguous_count] : random_int() % atoms_count;
+                if(molecule_move(&molecule, atom_id, local ? ambiguous : NULL, 0) >= 0) moves++;
+            }
+            if(moves == 0) break;
+        } else if(rebalanced_atom_id >= 0) {
+            undo_atom_ids[undo_count] = rebalanced_atom_id;
+            undo_kinds[undo_count++] = atoms[rebalanced_atom_id].kind;
+            atoms[rebalanced_atom_id].kind = rebalanced_kind;
+        } else {
+            AtomKind old_kinds[MAX_CHOICES];
+            int indices[MAX_CHOICES];
+            for(int i = 0; i < choices_count; i++) {
+                if(unspecified_atoms_count > 0) {
+                    indices[i] = unspecified_atom_ids[unspecified_atoms_count-1];
+                    unspecified_atoms_count--;
+                } else if(core_count > 0) {
+                    indices[i] = core_atom_ids[random_int() % core_count];
+                } else if(ambiguous_count > 0) {
+                    indices[i] = ambiguous_atom_ids[random_int() % ambiguous_count];
+                } else {
+                    indices[i] = random_int() % atoms_count;
+                }
+                old_kinds[i] = atoms[indices[i]].kind;
             }
-            negative_assignment[set_variables++] = 0;
-            picosat_add_lits(ps, negative_assignment);
+
+            for(int i = 0; i < choices_count; i++) {
+                while(old_kinds[i] == atoms[indices[i]].kind) {
+                    atoms[indices[i]].kind = sample_distribution(distribution, distribution_length, distribution_total);
+                }
+                undo_atom_ids[undo_count] = indices[i];
+                undo_kinds[undo_count++] = old_kinds[i];
+            }
+        }
+        // A unique candidate ends the loop, so it is never stored. Then
+        // even a collision of keys cannot produce a puzzle.
+        SolveValue solve_value;
+        int tabled = options.table_memory > 0;
+        uint64_t key = tabled ? table_key(max_solutions) : 0;
+        if(!tabled || !table_lookup(key, &solve_value)) {
+            solve_value = portfolio.members_count > 0 ? portfolio_solve(max_solutions) :
+                          session ? session_solve(session, max_solutions) : solve(max_solutions);
+            if(tabled && !interrupted && solve_value.num_solutions != 1) table_store(key, solve_value);
+        }
+        int new_num_solutions = solve_value.num_solutions;
+        iterations++;
+        temperature *= ANNEAL_COOLING;
+
+        if(new_num_solutions == 1) {
+            unique = 1;
+            break;
+        } else if(anneal && new_num_solutions > old_num_solutions &&
+                  random_double() >= exp((old_num_solutions - new_num_solutions)/temperature)) {
+            generate_undo(undo_atom_ids, undo_kinds, undo_count);
+            undo_count = 0;
+            choices_count = max(choices_count - 1, NUM_CHOICES);
+        } else if(1 <= new_num_solutions) {
+            if(report && options.interactive) print(1);
+            if(anneal && new_num_solutions < old_num_solutions) choices_count = min(choices_count + 1, MAX_CHOICES);
+            old_num_solutions = new_num_solutions;
+            failures = 0;
+            undo_count = 0;
+            repairs = 0;
+            core_count = 0;
+            if(options.mutation == MUTATION_DIFF) {
+                memset(ambiguous, 0, atoms_count);
+                ambiguous_count = 0;
+                for(int i = 0; i < bonds_count; i++) {
+                    if(bonds[i].solution == bonds[i].alternative) continue;
+                    int ends[2] = { bonds[i].atom_id1, bonds[i].atom_id2 };
+                    for(int j = 0; j < 2; j++) {
+                        if(ends[j] >= 0 && !ambiguous[ends[j]]) {
+                            ambiguous[ends[j]] = 1;
+                            ambiguous_atom_ids[ambiguous_count++] = ends[j];
+                        }
+                    }
+                }
+            }
+        } else if(molecule.orders) {
+            // A molecule always has a solution, so the template has none.
+            break;
         } else {
-            for(int i = 0; i < new_cut_edges_count; i++) {
-                add_to_cut_set(new_cut_edges[i]);
-                picosat_add(ps, new_cut_edges[i]);
+            if(++failures >= atoms_count) ambiguous_count = 0;
+            core_count = 0;
+            for(int i = 0; repairs < options.core_repairs && i < atoms_count; i++) {
+                if(atoms[i].failed) core_atom_ids[core_count++] = i;
             }
-            if(new_cut_edges_count > 0) {
-                add_to_cut_set(0);
-                picosat_add(ps, 0);
+            if(core_count > 0) {
+                repairs++;
+            } else {
+                generate_undo(undo_atom_ids, undo_kinds, undo_count);
+                undo_count = 0;
+                repairs = 0;
+                if(anneal) choices_count = max(choices_count - 1, NUM_CHOICES);
             }
         }
-        
+        if(report && !options.interactive) {
+            progress_report(iterations, new_num_solutions);
+        } else if(report) {
+            int atom_kinds_count[5] = { };
+            for(int i = 0; i < atoms_count; i++) {
+                atom_kinds_count[atoms[i].kind]++;
+            }
+            printf("\033[34;1H\033[K+ %i %i/%i %i %zuKB (%i %i %i %i %i)\n", iterations - 1, new_num_solutions, old_num_solutions,
+                   cut_set_live_count(), cut_set_bytes() / 1024,
+                   atom_kinds_count[0], atom_kinds_count[1], atom_kinds_count[2], atom_kinds_count[3], atom_kinds_count[4]);
+        }
     }
-    picosat_reset(ps);
-    return (SolveValue) {
-        .num_solutions = solutions_count,
-        .num_decisions = num_decisions,
+    arena_release(&scratch, mark);
+    return (GenerateValue) {
+        .iterations = iterations,
+        .unique = unique,
     };
 }
 
-int sample_distribution(int* distribution, int length, int total) {
-    int r = rand() % total;
-    for(int i = 0; i < length; i++) {
-        if(r < distribution[i]) {
-            return i;
+Session* generate_session(void) {
+    if(portfolio.members_count > 0) return NULL;
+    return options.fresh_solver || options.engine != ENGINE_SAT ? NULL : session_create();
+}
+
+GenerateValue generate(int* distribution, int distribution_length, int max_iterations, int report) {
+    Session* session = generate_session();
+    GenerateValue value = generate_in(session, distribution, distribution_length, max_iterations, report);
+    if(session) session_destroy(session);
+    return value;
+}
+
+typedef struct {
+    int id;
+    size_t cut_set_max_bytes;
+    char* puzzle;
+    int len;
+    int* distribution;
+    int distribution_length;
+    Stats stats;
+    // Set by every chain which finds a unique puzzle.
+    GenerateValue value;
+    AtomKind* kinds;
+    int* solutions;
+} Chain;
+
+void* chain_run(void* arg) {
+    Chain* chain = arg;
+    chain_id = chain->id;
+    random_stream = random_split(random_seed, 1 + chain->id);
+    cut_set.max_bytes = chain->cut_set_max_bytes;
+    parse(chain->puzzle, chain->len);
+    if(options.cache_directory) cut_cache_load(options.cache_directory);
+    chain_published_id = cut_set.next_id;
+
+    // Only the first chain shows its progress.
+    GenerateValue value = generate(chain->distribution, chain->distribution_length, 0, chain->id == 0);
+    if(value.unique) {
+        chain->value = value;
+        chain->kinds = malloc(atoms_count*sizeof(AtomKind));
+        chain->solutions = malloc(bonds_count*sizeof(int));
+        for(int i = 0; i < atoms_count; i++) chain->kinds[i] = atoms[i].kind;
+        for(int i = 0; i < bonds_count; i++) chain->solutions[i] = bonds[i].solution;
+        long long key = (long long) value.iterations*options.threads + chain->id;
+        long long best = atomic_load(&chains.best);
+        while(key < best && !atomic_compare_exchange_weak(&chains.best, &best, key));
+    }
+    chain->stats = stats;
+    chains_exchange_cuts();
+
+    free(cut_set.clauses);
+    free(cut_set.lits);
+    free(cut_set.table);
+    table_free();
+    frontier_free();
+    arena_free(&puzzle_arena);
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Runs options.threads chains on the puzzle, which the calling thread has
+// parsed as well, and copies the result of the winning chain into it. The
+// calling thread also takes over the connectivity clauses and the stats of
+// all chains.
+Chain generate_chains(char* puzzle, int len, int* distribution, int distribution_length) {
+    int threads_count = options.threads;
+    Chain chain_list[threads_count];
+    pthread_t threads[threads_count];
+    chain_published_id = cut_set.next_id;
+    for(int i = 0; i < threads_count; i++) {
+        chain_list[i] = (Chain) {
+            .id = i,
+            .cut_set_max_bytes = cut_set.max_bytes,
+            .puzzle = puzzle,
+            .len = len,
+            .distribution = distribution,
+            .distribution_length = distribution_length,
+        };
+        pthread_create(&threads[i], NULL, chain_run, &chain_list[i]);
+    }
+    for(int i = 0; i < threads_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    chains_exchange_cuts();
+    free(chains.pool);
+    Chain winner = { .value = {} };
+    if(chains_winner() >= 0) {
+        winner = chain_list[chains_winner()];
+        for(int i = 0; i < atoms_count; i++) atoms[i].kind = winner.kinds[i];
+        for(int i = 0; i < bonds_count; i++) bonds[i].solution = winner.solutions[i];
+    }
+    for(int i = 0; i < threads_count; i++) {
+        stats_add(&stats, &chain_list[i].stats);
+        free(chain_list[i].kinds);
+        free(chain_list[i].solutions);
+    }
+    return winner;
+}
+
+char* read_file(const char* file_name, int* len) {
+    FILE* fp = fopen(file_name, "r");
+    if(!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* result = malloc(*len);
+    fread(result, *len, 1, fp);
+    fclose(fp);
+    return result;
+}
+
+void reset_puzzle(void) {
+    arena_release(&puzzle_arena, (ArenaMark) {});
+    atoms_count = 0;
+    unspecified_atoms_count = 0;
+    bonds_count = 0;
+    cut_set_clear();
+    table_free();
+}
+
+// With --count the generator produces a batch of puzzles for one template
+// on options.threads workers. Each worker parses the template once, then
+// generates puzzle after puzzle starting from the kinds of the template.
+// Puzzle k draws from random stream 1 + k and starts from the cut set
+// loaded for the template with a solver of its own, so it does not depend
+// on the worker which claims it. The clauses it finds are published for
+// the cache, but not kept for the next puzzle, and --share-cuts does not
+// apply. Finished puzzles are written as files into options.out_directory,
+// or to stdout in the order of their numbers, holding back those which
+// finish early in pending. A puzzle which fails, as when the run is
+// interrupted, is marked in skipped, so the ones after it are not held
+// back.
+typedef struct {
+    pthread_mutex_t mutex;
+    atomic_int claimed;
+    int written;
+    char** pending;
+    char* skipped;
+    int next_pending;
+    Stats stats;
+} Batch;
+
+Batch batch = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Called with the mutex held.
+void batch_progress(void) {
+    double now = seconds();
+    if(now - progress_last < PROGRESS_INTERVAL) return;
+    progress_last = now;
+    fprintf(progress_file ? progress_file : stderr, "%.1fs: %i puzzles, %.2f puzzles/s\n", now - progress_start,
+            batch.written, batch.written / max(now - progress_start, 1e-9));
+    fflush(progress_file ? progress_file : stderr);
+}
+
+// Prints the pending puzzles up to the first one which is neither
+// finished nor skipped. Called with the mutex held.
+void batch_flush(void) {
+    for(; batch.next_pending < options.batch_count; batch.next_pending++) {
+        char* text = batch.pending[batch.next_pending];
+        if(!text && !batch.skipped[batch.next_pending]) break;
+        if(!text) continue;
+        printf("%s\n", text);
+        free(text);
+        batch.pending[batch.next_pending] = NULL;
+        batch.written++;
+    }
+    fflush(stdout);
+}
+
+void batch_write(int number) {
+    if(options.out_directory) {
+        char file_name[1024];
+        snprintf(file_name, sizeof(file_name), "%s/puzzle-%05i.txt", options.out_directory, number + 1);
+        FILE* fp = fopen(file_name, "wb");
+        if(fp) {
+            print_file(fp);
+            fclose(fp);
         } else {
-            r -= distribution[i];
+            fprintf(stderr, "cannot write %s\n", file_name);
         }
+        pthread_mutex_lock(&batch.mutex);
+        batch.written++;
+        batch_progress();
+        pthread_mutex_unlock(&batch.mutex);
+        return;
     }
-    assert(0);
+    char* text = NULL;
+    size_t text_length = 0;
+    FILE* fp = open_memstream(&text, &text_length);
+    print_file(fp);
+    fclose(fp);
+    pthread_mutex_lock(&batch.mutex);
+    batch.pending[number] = text;
+    batch_flush();
+    batch_progress();
+    pthread_mutex_unlock(&batch.mutex);
+}
+
+void batch_skip(int number) {
+    pthread_mutex_lock(&batch.mutex);
+    batch.skipped[number] = 1;
+    if(batch.pending) batch_flush();
+    pthread_mutex_unlock(&batch.mutex);
+}
+
+void* batch_run(void* arg) {
+    Chain* worker = arg;
+    chain_id = worker->id;
+    cut_set.max_bytes = worker->cut_set_max_bytes;
+    parse(worker->puzzle, worker->len);
+    if(options.cache_directory) cut_cache_load(options.cache_directory);
+    chain_published_id = cut_set.next_id;
+
+    AtomKind* template_kinds = arena_alloc(&puzzle_arena, atoms_count*sizeof(AtomKind));
+    for(int i = 0; i < atoms_count; i++) template_kinds[i] = atoms[i].kind;
+    int template_unspecified_count = unspecified_atoms_count;
+    CutSet template_cut_set = {};
+    cut_set_assign(&template_cut_set, &cut_set);
+    int number;
+    while(!interrupted && (number = atomic_fetch_add(&batch.claimed, 1)) < options.batch_count) {
+        random_stream = random_split(random_seed, 1 + number);
+        for(int i = 0; i < atoms_count; i++) atoms[i].kind = template_kinds[i];
+        unspecified_atoms_count = template_unspecified_count;
+        cut_set_assign(&cut_set, &template_cut_set);
+        chain_published_id = cut_set.next_id;
+        GenerateValue value = generate(worker->distribution, worker->distribution_length, 0, 0);
+        chains_publish_cuts();
+        if(value.unique) batch_write(number);
+        else batch_skip(number);
+    }
+    free(template_cut_set.clauses);
+    free(template_cut_set.lits);
+    free(template_cut_set.table);
+
+    pthread_mutex_lock(&batch.mutex);
+    stats_add(&batch.stats, &stats);
+    pthread_mutex_unlock(&batch.mutex);
+
+    free(cut_set.clauses);
+    free(cut_set.lits);
+    free(cut_set.table);
+    table_free();
+    frontier_free();
+    arena_free(&puzzle_arena);
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Generates the batch from the puzzle, which the calling thread has parsed
+// as well, and takes over the connectivity clauses of all workers.
+int generate_batch(char* puzzle, int len, int* distribution, int distribution_length) {
+    if(options.out_directory) mkdir(options.out_directory, 0777);
+    else batch.pending = calloc(options.batch_count, sizeof(char*));
+    batch.skipped = calloc(options.batch_count, 1);
+    int workers_count = max(options.threads, 1);
+    Chain workers[workers_count];
+    pthread_t threads[workers_count];
+    chain_published_id = cut_set.next_id;
+    double start = seconds();
+    progress_start = progress_last = start;
+    for(int i = 0; i < workers_count; i++) {
+        workers[i] = (Chain) {
+            .id = i,
+            .cut_set_max_bytes = cut_set.max_bytes,
+            .puzzle = puzzle,
+            .len = len,
+            .distribution = distribution,
+            .distribution_length = distribution_length,
+        };
+        pthread_create(&threads[i], NULL, batch_run, &workers[i]);
+    }
+    for(int i = 0; i < workers_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = seconds() - start;
+    chains_exchange_cuts();
+    free(chains.pool);
+    // Once the workers are done, nothing finished is held back any more.
+    if(batch.pending) {
+        for(int i = batch.next_pending; i < options.batch_count; i++) batch.skipped[i] |= !batch.pending[i];
+        batch_flush();
+        free(batch.pending);
+    }
+    int claimed = min(atomic_load(&batch.claimed), options.batch_count);
+    int skipped_count = 0;
+    for(int i = 0; i < claimed; i++) {
+        if(!batch.skipped[i]) continue;
+        fprintf(stderr, "%s%i", skipped_count++ ? ", " : "puzzles not generated: ", i + 1);
+    }
+    if(skipped_count > 0) fprintf(stderr, "\n");
+    free(batch.skipped);
+
+    fprintf(stderr, "%i puzzles in %.2f seconds, %.2f puzzles/sec, %lli solves, %.2f refinements per solve\n",
+            batch.written, elapsed, batch.written / elapsed, batch.stats.solves,
+            (double) batch.stats.cegar_iterations / max(batch.stats.solves, 1));
+    if(options.stats) stats_print(stderr, &batch.stats, options.stats == STATS_JSON);
+    return batch.written < options.batch_count;
+}
+
+#define BENCH_SEED 1
+#define BENCH_ITERATIONS 200
+#define BENCH_COUNTS 10
+
+typedef struct {
+    char* name;
+    Options options;
+} BenchConfig;
+
+BenchConfig bench_configs[] = {
+    { "fresh",     { .fresh_solver = 1 } },
+    { "session",   { .fresh_solver = 0 } },
+    { "selectors", { .selectors = 1 } },
+    { "eager",     { .connectivity = CONNECTIVITY_EAGER } },
+    { "single-cut", { .single_cut = 1 } },
+    { "native",    { .valence = VALENCE_NATIVE } },
+    { "backtrack", { .engine = ENGINE_BACKTRACK } },
+    { "frontier",  { .engine = ENGINE_FRONTIER } },
+    { "diff",      { .mutation = MUTATION_DIFF } },
+    { "molecule",  { .mutation = MUTATION_DIFF, .generation = GENERATION_MOLECULE } },
+    { "repair",    { .mutation = MUTATION_DIFF, .core_repairs = 3 } },
+    { "anneal",    { .mutation = MUTATION_DIFF, .search = SEARCH_ANNEAL } },
+    { "table",     { .mutation = MUTATION_DIFF, .table_memory = DEFAULT_TABLE_MB } },
+};
+
+// These count the solutions of BENCH_COUNTS sampled molecules up to
+// MAX_SOLUTIONS instead of generating.
+BenchConfig bench_count_configs[] = {
+    { "count",          { .engine = ENGINE_SAT } },
+    { "count-frontier", { .engine = ENGINE_FRONTIER } },
+};
+
+char* bench_templates[] = { "tiny", "small", "medium", "large", "gigantic" };
+
+void bench_print(const char* template, const char* config, int solves, double elapsed) {
+    printf("%-10s %-14s %8i %8.3f %10.1f %9lli %9lli %11.2f %9i %6i %8zu\n", template, config,
+           solves, elapsed, solves / elapsed, stats.sat_calls, stats.cegar_iterations,
+           (double) stats.cegar_iterations / max(stats.solves, 1), stats.max_clauses, cut_set_live_count(), cut_set_bytes() / 1024);
+}
+
+// Runs BENCH_ITERATIONS generator steps per template and configuration. The
+// seed is fixed and the configurations mutate randomly, so they all see the
+// same sequence of puzzles. Only diff aims its mutations at the solutions,
+// molecule samples molecules instead of kinds, repair also repairs
+// candidates without solution, and anneal anneals on the solution count.
+// Only table looks up repeated candidates instead of solving them. The
+// count rows compare the engines on exhaustive counting, where the
+// frontier engine needs no more work for many solutions than for two.
+int bench(int argc, const char** argv) {
+    int templates_count = argc > 0 ? argc : (int) array_length(bench_templates);
+    printf("%-10s %-14s %8s %8s %10s %9s %9s %11s %9s %6s %8s\n", "template", "config", "solves", "seconds", "solves/sec",
+           "sat calls", "cegar", "cegar/solve", "clauses", "cuts", "cut KB");
+    for(int t = 0; t < templates_count; t++) {
+        const char* template = argc > 0 ? argv[t] : bench_templates[t];
+        int len = 0;
+        char* puzzle = read_file(template, &len);
+        if(!puzzle) {
+            printf("%s: cannot read template\n", template);
+            return 1;
+        }
+        for(int c = 0; c < (int) array_length(bench_configs); c++) {
+            reset_puzzle();
+            parse(puzzle, len);
+            options = bench_configs[c].options;
+            stats = (Stats) {};
+            int distribution[] = { 0, 1, 5, 8, 3 };
+            random_stream = random_split(BENCH_SEED, 0);
+            double start = seconds();
+            GenerateValue value = generate(distribution, array_length(distribution), BENCH_ITERATIONS, 0);
+            double elapsed = seconds() - start;
+            bench_print(template, bench_configs[c].name, value.iterations, elapsed);
+        }
+        for(int c = 0; c < (int) array_length(bench_count_configs); c++) {
+            reset_puzzle();
+            parse(puzzle, len);
+            options = bench_count_configs[c].options;
+            stats = (Stats) {};
+            int distribution[] = { 0, 1, 5, 8, 3 };
+            ArenaMark mark = arena_mark(&scratch);
+            Molecule molecule = {
+                .distribution = distribution,
+                .orders = arena_alloc(&scratch, bonds_count),
+                .seen = arena_alloc(&scratch, atoms_count*sizeof(int)),
+                .queue = arena_alloc(&scratch, atoms_count*sizeof(int)),
+            };
+            memset(molecule.seen, 0, atoms_count*sizeof(int));
+            random_stream = random_split(BENCH_SEED, 0);
+            double elapsed = 0;
+            for(int i = 0; i < BENCH_COUNTS; i++) {
+                molecule_sample(&molecule);
+                double start = seconds();
+                solve(MAX_SOLUTIONS);
+                elapsed += seconds() - start;
+            }
+            arena_release(&scratch, mark);
+            bench_print(template, bench_count_configs[c].name, BENCH_COUNTS, elapsed);
+        }
+        free(puzzle);
+    }
+    return 0;
+}
+
+// Lays out a honeycomb of roughly the given number of atoms in the format
+// of the template files. Atoms on the border which would keep fewer than
+// two bonds are dropped, and so are the bonds they leave dangling.
+char* hex_template(int atoms_wanted, int* len) {
+    int cells = 1;
+    while(4*cells*cells < atoms_wanted) cells++;
+    int width = 8*cells + 1;
+    int height = 4*cells + 1;
+    int stride = width + 1;
+    char* text = malloc((size_t) stride*height);
+    // One period of the pattern of the bundled templates.
+    const char* pattern[4] = { "  X-X   ", " /   \\  ", "X     X-", " \\   /  " };
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            text[y*stride + x] = pattern[y % 4][x % 8];
+        }
+        text[y*stride + width] = '\n';
+    }
+    int* degrees = malloc((size_t) stride*height*sizeof(int));
+    int changed = 1;
+    while(changed) {
+        changed = 0;
+        memset(degrees, 0, (size_t) stride*height*sizeof(int));
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x++) {
+                char c = text[y*stride + x];
+                if(c != '-' && c != '/' && c != '\\') continue;
+                int dy = c == '-' ? 0 : c == '/' ? -1 : 1;
+                int x1 = x - 1, y1 = y - dy, x2 = x + 1, y2 = y + dy;
+                if(x1 < 0 || y1 < 0 || y1 >= height || text[y1*stride + x1] != 'X' ||
+                   x2 >= width || y2 < 0 || y2 >= height || text[y2*stride + x2] != 'X') {
+                    text[y*stride + x] = ' ';
+                    changed = 1;
+                    continue;
+                }
+                degrees[y1*stride + x1]++;
+                degrees[y2*stride + x2]++;
+            }
+        }
+        for(int i = 0; i < stride*height; i++) {
+            if(text[i] == 'X' && degrees[i] < 2) {
+                text[i] = ' ';
+                changed = 1;
+            }
+        }
+    }
+    free(degrees);
+    *len = stride*height;
+    return text;
+}
+
+#define SCALE_ITERATIONS 20
+
+// Runs SCALE_ITERATIONS generator steps with the current options on
+// honeycombs of growing size, up to max_atoms atoms (50000 by default), and
+// reports the time per solve against the number of atoms.
+int scale(int argc, const char** argv) {
+    int max_atoms = argc > 0 ? atoi(argv[0]) : 50000;
+    int sizes[] = { 100, 300, 1000, 3000, 10000, 30000, 50000 };
+    printf("%8s %8s %9s %8s %9s %11s %9s\n", "atoms", "bonds", "parse ms", "solves", "ms/solve", "cegar/solve", "cut KB");
+    for(int i = 0; i < (int) array_length(sizes) && sizes[i] <= max_atoms; i++) {
+        int len = 0;
+        char* puzzle = hex_template(sizes[i], &len);
+        reset_puzzle();
+        double start = seconds();
+        parse(puzzle, len);
+        double parse_elapsed = seconds() - start;
+        free(puzzle);
+
+        stats = (Stats) {};
+        int distribution[] = { 0, 1, 5, 8, 3 };
+        random_stream = random_split(BENCH_SEED, 0);
+        start = seconds();
+        GenerateValue value = generate(distribution, array_length(distribution), SCALE_ITERATIONS, 0);
+        double elapsed = seconds() - start;
+        printf("%8i %8i %9.2f %8i %9.2f %11.2f %9zu\n", atoms_count, bonds_count, 1000*parse_elapsed, value.iterations,
+               1000*elapsed / max(value.iterations, 1), (double) stats.cegar_iterations / max(stats.solves, 1),
+               cut_set_bytes() / 1024);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+#define SUITE_SEEDS 2
+#define SUITE_MAX_ITERATIONS 1000
+#define SUITE_TIMEOUT 60
+
+typedef struct {
+    char* name;
+    int distribution[5];
+} SuiteDistribution;
+
+SuiteDistribution suite_distributions[] = {
+    { "default",  { 0, 1, 5, 8, 3 } },
+    { "hard",     { 0, 0, 1, 10, 10 } },
+    { "hydrogen", { 0, 4, 4, 4, 4 } },
+};
+
+// Generates a puzzle from the template with the current options, solves the
+// result once more from scratch and prints the measurements as a JSON
+// object. Runs in a process of its own, so that the peak memory belongs to
+// this case alone.
+void suite_case(const char* template, char* puzzle, int len, SuiteDistribution* distribution, int seed) {
+    parse(puzzle, len);
+    stats = (Stats) {};
+    random_stream = random_split(seed, 0);
+    double start = seconds();
+    GenerateValue value = generate(distribution->distribution, array_length(distribution->distribution),
+                                   SUITE_MAX_ITERATIONS, 0);
+    double generate_elapsed = seconds() - start;
+    Stats generate_stats = stats;
+
+    stats = (Stats) {};
+    start = seconds();
+    SolveValue solve_value = solve(2);
+    double solve_elapsed = seconds() - start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("  {\"template\": \"%s\", \"distribution\": \"%s\", \"seed\": %i, \"atoms\": %i, \"bonds\": %i,\n"
+           "   \"unique\": %s, \"seconds\": %.4f, \"iterations\": %i, \"sat_calls\": %lli, \"cegar_iterations\": %lli,\n"
+           "   \"decisions\": %lli, \"propagations\": %lli, \"cuts\": %i,\n"
+           "   \"solve_seconds\": %.4f, \"solve_solutions\": %i, \"solve_decisions\": %lli, \"solve_propagations\": %lli,\n"
+           "   \"peak_kb\": %li}",
+           template, distribution->name, seed, atoms_count, bonds_count,
+           value.unique ? "true" : "false", generate_elapsed, value.iterations, generate_stats.sat_calls,
+           generate_stats.cegar_iterations, generate_stats.decisions, generate_stats.propagations, cut_set_live_count(),
+           solve_elapsed, solve_value.num_solutions, stats.decisions, stats.propagations, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+// Runs every template (by default all bundled ones) with every distribution
+// of suite_distributions and SUITE_SEEDS fixed seeds, at most
+// SUITE_MAX_ITERATIONS generator steps each, and prints a JSON array with
+// one object per case. A case which takes longer than SUITE_TIMEOUT
+// seconds, which single hard solves can, is stopped and reported as such.
+// The cache is not used, so every case starts cold.
+int suite(int argc, const char** argv) {
+    int templates_count = argc > 0 ? argc : (int) array_length(bench_templates);
+    options.cache_directory = NULL;
+    printf("[\n");
+    int first = 1;
+    for(int t = 0; t < templates_count; t++) {
+        const char* template = argc > 0 ? argv[t] : bench_templates[t];
+        int len = 0;
+        char* puzzle = read_file(template, &len);
+        if(!puzzle) {
+            fprintf(stderr, "%s: cannot read template\n", template);
+            return 1;
+        }
+        for(int d = 0; d < (int) array_length(suite_distributions); d++) {
+            for(int seed = 1; seed <= SUITE_SEEDS; seed++) {
+                if(!first) printf(",\n");
+                first = 0;
+                fflush(stdout);
+                pid_t pid = fork();
+                if(pid == 0) {
+                    alarm(SUITE_TIMEOUT);
+                    suite_case(template, puzzle, len, &suite_distributions[d], seed);
+                    exit(0);
+                }
+                int status = 0;
+                waitpid(pid, &status, 0);
+                if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    int timeout = WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM;
+                    printf("  {\"template\": \"%s\", \"distribution\": \"%s\", \"seed\": %i, \"%s\": true}",
+                           template, suite_distributions[d].name, seed, timeout ? "timeout" : "error");
+                }
+                fprintf(stderr, "%s %s %i done\n", template, suite_distributions[d].name, seed);
+            }
+        }
+        free(puzzle);
+    }
+    printf("\n]\n");
+    return 0;
+}
+
+// Counts the solutions of a puzzle file, up to a given number which is at
+// most MAX_SOLUTIONS.
+int count(int argc, const char** argv) {
+    if(argc < 1) return -1;
+    int max_solutions = argc >= 2 ? atoi(argv[1]) : MAX_SOLUTIONS;
+    max_solutions = max(1, min(max_solutions, MAX_SOLUTIONS));
+    int len = 0;
+    char* puzzle = read_file(argv[0], &len);
+    if(!puzzle) return -1;
+    parse(puzzle, len);
+    if(options.cache_directory) cut_cache_load(options.cache_directory);
+    if(options.portfolio > 1) portfolio_start(puzzle, len);
+
+    double start = seconds();
+    SolveValue value = portfolio.members_count > 0 ? portfolio_solve(max_solutions) : solve(max_solutions);
+    double elapsed = seconds() - start;
+    printf("%i%s solutions, %i decisions, %.3f seconds\n", value.num_solutions,
+           value.num_solutions == max_solutions ? "+" : "", value.num_decisions, elapsed);
+    if(portfolio.members_count > 0) {
+        portfolio_stop();
+        portfolio_print_wins();
+    }
+    if(options.stats) stats_print(stdout, &stats, options.stats == STATS_JSON);
+    free(puzzle);
+    cut_cache_save();
+    return 0;
+}
+
+// The solve command reads puzzles separated by blank lines from a file or
+// stdin and prints the number of solutions of each, in input order. The
+// workers take turns reading the next puzzle, so the input is streamed.
+// Each worker keeps its parsed puzzle, connectivity clauses and solver
+// while the puzzles keep the shape of the last one, and then only swaps
+// the kinds of the atoms.
+typedef struct {
+    int done;
+    // Why the puzzle is malformed, or NULL.
+    const char* error;
+    SolveValue value;
+} SolveResult;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    FILE* fp;
+    int eof;
+    int max_solutions;
+    char* line;
+    size_t line_capacity;
+    int read;
+    int printed;
+    int unique;
+    // Results of puzzles which finished before an earlier one.
+    SolveResult* results;
+    int results_capacity;
+    Stats stats;
+} SolveStream;
+
+SolveStream solve_stream = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+int solve_blank(const char* line) {
+    for(; *line; line++) {
+        if(!strchr(" \t\r\n", *line)) return 0;
+    }
+    return 1;
+}
+
+// Reads the next puzzle into text, with carriage returns dropped. Returns
+// its length, or -1 at the end of the input. Called with the mutex held.
+int solve_read(char** text, size_t* capacity) {
+    size_t len = 0;
+    while(!solve_stream.eof) {
+        if(getline(&solve_stream.line, &solve_stream.line_capacity, solve_stream.fp) < 0) {
+            solve_stream.eof = 1;
+            break;
+        }
+        if(solve_blank(solve_stream.line)) {
+            if(len > 0) break;
+            continue;
+        }
+        size_t line_len = strcspn(solve_stream.line, "\r\n");
+        if(len + line_len + 1 > *capacity) {
+            *capacity = max(2*(*capacity), len + line_len + 1);
+            *text = realloc(*text, *capacity);
+        }
+        memcpy(*text + len, solve_stream.line, line_len);
+        len += line_len;
+        (*text)[len++] = '\n';
+    }
+    return len > 0 ? (int) len : -1;
+}
+
+// Called with the mutex held.
+void solve_write(int number, SolveResult result) {
+    if(number >= solve_stream.results_capacity) {
+        int capacity = max(2*solve_stream.results_capacity, number + 1024);
+        solve_stream.results = realloc(solve_stream.results, capacity*sizeof(SolveResult));
+        memset(solve_stream.results + solve_stream.results_capacity, 0, (capacity - solve_stream.results_capacity)*sizeof(SolveResult));
+        solve_stream.results_capacity = capacity;
+    }
+    solve_stream.results[number] = result;
+    solve_stream.results[number].done = 1;
+    while(solve_stream.printed < solve_stream.results_capacity && solve_stream.results[solve_stream.printed].done) {
+        SolveResult* r = &solve_stream.results[solve_stream.printed++];
+        if(r->error) {
+            printf("%i: invalid puzzle, %s\n", solve_stream.printed, r->error);
+            continue;
+        }
+        int n = r->value.num_solutions;
+        solve_stream.unique += n == 1;
+        printf("%i: %i%s solutions, %s, %i decisions\n", solve_stream.printed, n,
+               n == solve_stream.max_solutions && n > 1 ? "+" : "",
+               n == 0 ? "unsolvable" : n == 1 ? "unique" : "ambiguous", r->value.num_decisions);
+    }
+    fflush(stdout);
+}
+
+void* solve_run(void* arg) {
+    Chain* worker = arg;
+    random_stream = random_split(random_seed, 1 + worker->id);
+    cut_set.max_bytes = worker->cut_set_max_bytes;
+    char* text = NULL;
+    size_t text_capacity = 0;
+    // The last puzzle with its kinds replaced by X.
+    char* shape = NULL;
+    size_t shape_capacity = 0;
+    int shape_len = -1;
+    const char* shape_error = NULL;
+    // The hash of the template whose clauses are in cut_set.
+    uint64_t loaded_hash = 0;
+    int loaded = 0;
+    Session* session = NULL;
+    while(!interrupted) {
+        pthread_mutex_lock(&solve_stream.mutex);
+        int number = solve_stream.read;
+        int len = solve_read(&text, &text_capacity);
+        if(len >= 0) solve_stream.read++;
+        pthread_mutex_unlock(&solve_stream.mutex);
+        if(len < 0) break;
+
+        SolveResult result = {};
+        for(int i = 0; i < len; i++) {
+            if(!strchr(" \nXHONC-/\\", text[i])) result.error = "unknown character";
+        }
+        if(!result.error) {
+            int same_shape = len == shape_len;
+            for(int i = 0; same_shape && i < len; i++) {
+                same_shape = shape[i] == (strchr("HONC", text[i]) ? 'X' : text[i]);
+            }
+            if(same_shape) {
+                const char* kinds = "XHONC";
+                unspecified_atoms_count = 0;
+                int atom_id = 0;
+                for(int i = 0; i < len; i++) {
+                    const char* kind = strchr(kinds, text[i]);
+                    if(!kind) continue;
+                    atoms[atom_id].kind = kind - kinds;
+                    if(atoms[atom_id].kind == ATOM_UNSPECIFIED) unspecified_atom_ids[unspecified_atoms_count++] = atom_id;
+                    atom_id++;
+                }
+            } else {
+                if(session) session_destroy(session);
+                session = NULL;
+                // The clauses outlive the puzzle as long as the template
+                // hashes the same, as they only depend on its bonds.
+                CutSet kept = cut_set;
+                cut_set = (CutSet) { .max_bytes = kept.max_bytes };
+                reset_puzzle();
+                parse(text, len);
+                if(loaded && template_hash() == loaded_hash) {
+                    free(cut_set.clauses);
+                    free(cut_set.lits);
+                    free(cut_set.table);
+                    cut_set = kept;
+                } else {
+                    free(kept.clauses);
+                    free(kept.lits);
+                    free(kept.table);
+                    if(options.cache_directory) cut_cache_load(options.cache_directory);
+                    loaded_hash = template_hash();
+                    loaded = 1;
+                }
+                // The engines disagree on bonds without atoms at both ends,
+                // and the encodings of the valences only cover atoms with
+                // two or three bonds.
+                shape_error = NULL;
+                for(int i = 0; i < bonds_count; i++) {
+                    if(bonds[i].atom_id1 < 0 || bonds[i].atom_id2 < 0) shape_error = "bond without an atom at each end";
+                }
+                for(int i = 0; i < atoms_count && !shape_error; i++) {
+                    Link link = get_atom_link(i);
+                    if(link.count < 2 || link.count > 3) shape_error = "atom without two or three bonds";
+                }
+                if((size_t) len > shape_capacity) {
+                    shape_capacity = len;
+                    shape = realloc(shape, shape_capacity);
+                }
+                for(int i = 0; i < len; i++) shape[i] = strchr("HONC", text[i]) ? 'X' : text[i];
+                shape_len = len;
+            }
+            result.error = shape_error;
+        }
+        if(!result.error) {
+            if(!session && options.engine == ENGINE_SAT && !options.fresh_solver) session = session_create();
+            result.value = session ? session_solve(session, solve_stream.max_solutions) : solve(solve_stream.max_solutions);
+        }
+
+        pthread_mutex_lock(&solve_stream.mutex);
+        solve_write(number, result);
+        pthread_mutex_unlock(&solve_stream.mutex);
+    }
+    if(session) session_destroy(session);
+    free(text);
+    free(shape);
+
+    pthread_mutex_lock(&solve_stream.mutex);
+    stats_add(&solve_stream.stats, &stats);
+    pthread_mutex_unlock(&solve_stream.mutex);
+
+    free(cut_set.clauses);
+    free(cut_set.lits);
+    free(cut_set.table);
+    table_free();
+    frontier_free();
+    arena_free(&puzzle_arena);
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Solves the puzzles in argv[0], or on stdin if it is missing or "-", on
+// options.threads workers. The sessions of the workers encode every kind
+// of every atom up front (as with --selectors), so that they serve all
+// puzzles of the same shape.
+int solve_puzzles(int argc, const char** argv) {
+    const char* file_name = argc >= 1 && strcmp(argv[0], "-") != 0 ? argv[0] : NULL;
+    int max_solutions = argc >= 2 ? atoi(argv[1]) : 2;
+    solve_stream.max_solutions = max(1, min(max_solutions, MAX_SOLUTIONS));
+    solve_stream.fp = file_name ? fopen(file_name, "r") : stdin;
+    if(!solve_stream.fp) return -1;
+    options.selectors = 1;
+    signal(SIGINT, interrupt_handler);
+
+    int workers_count = max(options.threads, 1);
+    Chain workers[workers_count];
+    pthread_t threads[workers_count];
+    double start = seconds();
+    for(int i = 0; i < workers_count; i++) {
+        workers[i] = (Chain) {
+            .id = i,
+            .cut_set_max_bytes = cut_set.max_bytes,
+        };
+        pthread_create(&threads[i], NULL, solve_run, &workers[i]);
+    }
+    for(int i = 0; i < workers_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = seconds() - start;
+    if(file_name) fclose(solve_stream.fp);
+    free(solve_stream.line);
+    free(solve_stream.results);
+
+    fprintf(stderr, "%i puzzles in %.2f seconds, %.2f puzzles/sec, %i unique\n", solve_stream.printed, elapsed,
+            solve_stream.printed / elapsed, solve_stream.unique);
+    if(options.stats) stats_print(stderr, &solve_stream.stats, options.stats == STATS_JSON);
     return 0;
 }
 
 void usage(const char* argv0) {
-    printf("Usage: %s size [#H #O #N #C]\n"
+    printf("Usage: %s [options] size [#H #O #N #C]\n"
+           "       %s count puzzle [N]\n"
+           "       %s solve [puzzles|-] [N]\n"
+           "       %s bench [template...]\n"
+           "       %s scale [max_atoms]\n"
+           "       %s suite [template...]\n"
            "where size is the name of a template file (for example 'medium')\n"
            "and #H, #O, #N, #C are integers indicating the probabilities"
            "that the respective atoms are chosen.\n\n"
            "The program generates a puzzle of the respective size"
-           "and writes it into 'puzzle.txt'.\n", argv0);
+           "and writes it into 'puzzle.txt'.\n\n"
+           "  --engine sat|backtrack|frontier\n"
+           "                 solve with picosat (default), with a dedicated\n"
+           "                 backtracking search, or count the solutions by dynamic\n"
+           "                 programming along the rows of the template\n"
+           "  --threads N    run N independent generator chains in parallel and keep\n"
+           "                 the first unique puzzle\n"
+           "  --share-cuts   let the chains of --threads share connectivity clauses\n"
+           "  --mutation diff|random\n"
+           "                 after two solutions were found mutate atoms at the bonds\n"
+           "                 in which they differ (default), or any atom\n"
+           "  --generation kinds|molecule\n"
+           "                 sample the kinds of the atoms (default), or a connected\n"
+           "                 molecule whose bond sums give the kinds, so that every\n"
+           "                 candidate has a solution\n"
+           "  --search greedy|anneal\n"
+           "                 keep every candidate with solutions (default), or anneal\n"
+           "                 on the number of solutions and adapt the number of\n"
+           "                 atoms mutated per step\n"
+           "  --core-repairs N\n"
+           "                 mutate a candidate without solution up to N times at\n"
+           "                 the atoms which cause it before reverting it (default 0)\n"
+           "  --interactive  draw the puzzle and the progress on the terminal\n"
+           "  --progress F   append progress reports to F instead of stderr\n"
+           "  --stats [table|json]\n"
+           "                 print counters and timers of the solvers at the end\n"
+           "  --seed S       derive all random choices from S, so that runs with the same\n"
+           "                 seed and number of threads find the same puzzle (implies\n"
+           "                 --no-cache, not with --share-cuts or --portfolio)\n"
+           "  --portfolio N  race N differently configured SAT solvers on every solve\n"
+           "                 and take the first answer (not with --threads or --count)\n"
+           "  --count N      generate a batch of N puzzles, on --threads workers\n"
+           "  --out DIR      write the puzzles of a batch into DIR instead of stdout\n"
+           "  --fresh        rebuild the SAT solver for every solve\n"
+           "  --selectors    encode all atom kinds once and select them by assumptions\n"
+           "  --connectivity lazy|eager\n"
+           "                 check connectivity after each model and add cut clauses\n"
+           "                 (lazy, default) or encode it into the formula (eager)\n"
+           "  --single-cut   only add the cut around the component of the first atom\n"
+           "  --valence clausal|native\n"
+           "                 encode the valence of each atom as clauses (default) or\n"
+           "                 as one native cardinality constraint in the SAT solver\n"
+           "  --cut-memory M keep at most M MB of connectivity clauses (default " STR(DEFAULT_CUT_SET_MB) ")\n"
+           "  --table-memory M\n"
+           "                 remember the solves of at most M MB of candidates, 0 to\n"
+           "                 solve every candidate (default " STR(DEFAULT_TABLE_MB) ")\n"
+           "  --cache DIR    directory of the connectivity clause cache (default 'cache')\n"
+           "  --no-cache     neither load nor save connectivity clauses\n\n"
+           "The bench command measures solves/sec of the generator for each\n"
+           "solver configuration on every template. The scale command measures the\n"
+           "time per solve on generated honeycombs of up to max_atoms atoms. The suite\n"
+           "command generates and solves puzzles end to end with fixed seeds and\n"
+           "prints the measurements as JSON.\n\n"
+           "The count command counts the solutions of a puzzle file up to N\n"
+           "(at most and by default " STR(MAX_SOLUTIONS) ").\n\n"
+           "The solve command reads puzzles separated by blank lines from a file\n"
+           "or stdin and counts the solutions of each up to N (2 by default) on\n"
+           "--threads workers, printing one line per puzzle in input order.\n", argv0, argv0, argv0, argv0, argv0, argv0);
 }
 
 int main(int argc, const char** argv) {
 #if DEBUG
     test_synthesize_sum_ieq();
     return 0;
-#endif    
+#endif
+
+    const char* args[argc];
+    int args_count = 0;
+    int seeded = 0;
+    args[args_count++] = argv[0];
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "sat") == 0) {
+                options.engine = ENGINE_SAT;
+            } else if(strcmp(argv[i], "backtrack") == 0) {
+                options.engine = ENGINE_BACKTRACK;
+            } else if(strcmp(argv[i], "frontier") == 0) {
+                options.engine = ENGINE_FRONTIER;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            options.batch_count = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            options.out_directory = argv[++i];
+        } else if(strcmp(argv[i], "--mutation") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "random") == 0) {
+                options.mutation = MUTATION_RANDOM;
+            } else if(strcmp(argv[i], "diff") == 0) {
+                options.mutation = MUTATION_DIFF;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--generation") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "kinds") == 0) {
+                options.generation = GENERATION_KINDS;
+            } else if(strcmp(argv[i], "molecule") == 0) {
+                options.generation = GENERATION_MOLECULE;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--search") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "greedy") == 0) {
+                options.search = SEARCH_GREEDY;
+            } else if(strcmp(argv[i], "anneal") == 0) {
+                options.search = SEARCH_ANNEAL;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--core-repairs") == 0 && i + 1 < argc) {
+            options.core_repairs = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--interactive") == 0) {
+            options.interactive = 1;
+        } else if(strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+            options.progress_file_name = argv[++i];
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            options.stats = STATS_TABLE;
+            if(i + 1 < argc && strcmp(argv[i + 1], "table") == 0) {
+                i++;
+            } else if(i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+                options.stats = STATS_JSON;
+                i++;
+            }
+        } else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            random_seed = strtoull(argv[++i], NULL, 0);
+            seeded = 1;
+        } else if(strcmp(argv[i], "--portfolio") == 0 && i + 1 < argc) {
+            options.portfolio = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--share-cuts") == 0) {
+            options.share_cuts = 1;
+        } else if(strcmp(argv[i], "--fresh") == 0) {
+            options.fresh_solver = 1;
+        } else if(strcmp(argv[i], "--selectors") == 0) {
+            options.selectors = 1;
+        } else if(strcmp(argv[i], "--single-cut") == 0) {
+            options.single_cut = 1;
+        } else if(strcmp(argv[i], "--connectivity") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "lazy") == 0) {
+                options.connectivity = CONNECTIVITY_LAZY;
+            } else if(strcmp(argv[i], "eager") == 0) {
+                options.connectivity = CONNECTIVITY_EAGER;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--valence") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "clausal") == 0) {
+                options.valence = VALENCE_CLAUSAL;
+            } else if(strcmp(argv[i], "native") == 0) {
+                options.valence = VALENCE_NATIVE;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.cache_directory = argv[++i];
+        } else if(strcmp(argv[i], "--no-cache") == 0) {
+            options.cache_directory = NULL;
+        } else if(strcmp(argv[i], "--cut-memory") == 0 && i + 1 < argc) {
+            cut_set.max_bytes = (size_t) atoi(argv[++i]) * 1024 * 1024;
+        } else if(strcmp(argv[i], "--table-memory") == 0 && i + 1 < argc) {
+            options.table_memory = atoi(argv[++i]);
+        } else if(strncmp(argv[i], "--", 2) == 0) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            args[args_count++] = argv[i];
+        }
+    }
+    argc = args_count;
+    argv = args;
+    if(!seeded) getrandom(&random_seed, sizeof(random_seed), 0);
+    // The cached clauses change the models picosat finds, and so the
+    // mutations, so a seeded run doesn't use the cache.
+    if(seeded) options.cache_directory = NULL;
+    random_stream = random_split(random_seed, 0);
+    if(options.portfolio > 1 && (options.engine != ENGINE_SAT || options.threads > 1 || options.batch_count > 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Shared clauses and interrupted portfolio members arrive whenever the
+    // other threads get there, which a seed can't repeat.
+    if(seeded && (options.share_cuts || options.portfolio > 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return bench(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "suite") == 0) {
+        return suite(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "scale") == 0) {
+        return scale(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "count") == 0) {
+        int result = count(argc - 2, argv + 2);
+        if(result < 0) usage(argv[0]);
+        return result < 0;
+    }
+    if(argc >= 2 && strcmp(argv[1], "solve") == 0) {
+        int result = solve_puzzles(argc - 2, argv + 2);
+        if(result < 0) usage(argv[0]);
+        return result < 0;
+    }
 
     int len = 0;
     char* puzzle = NULL;
 
     if(argc >= 2) {
-        FILE* fp = fopen(argv[1], "r");
-        if(fp) {
-            fseek(fp, 0, SEEK_END);
-            len = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-            puzzle = malloc(len);
-            fread(puzzle, len, 1, fp);
-            fclose(fp);
-        }
+        puzzle = read_file(argv[1], &len);
     }
     if(puzzle == NULL) {
         usage(argv[0]);
         return 1;
     }
-    
-    system("clear");
-    parse(puzzle, len);
-    unsigned int seed;
-    getrandom(&seed, sizeof(seed), 0);
-    srand(seed);
-
-    int atom_scale = 1; (void) atom_scale;
-    
-    int iterations = 0;
-    int old_num_solutions = atom_scale*atoms_count; (void) old_num_solutions;
 
+    signal(SIGINT, interrupt_handler);
 
     int distribution[] = {
         0, 1, 5, 8, 3
@@ -541,57 +4305,51 @@ int main(int argc, const char** argv) {
         distribution[3] = atoi(argv[4]);
         distribution[4] = atoi(argv[5]);
     }
-    
-    int distribution_total = 0;
-    for(int i = 0; i < distribution_length; i++) {
-        distribution_total += distribution[i];
-    }
-#define NUM_CHOICES 2
-    while(1) {
-        AtomKind old_kinds[NUM_CHOICES];
-        int indices[NUM_CHOICES];
-        for(int i = 0; i < NUM_CHOICES; i++) {
-            if(unspecified_atoms_count > 0) {
-                indices[i] = unspecified_atom_ids[unspecified_atoms_count-1];
-                unspecified_atoms_count--;
-            } else {
-                indices[i] = rand() % atoms_count;
-            }
-            old_kinds[i] = atoms[indices[i]].kind;
-        }
-
 
-        for(int i = 0; i < NUM_CHOICES; i++) {
-            while(old_kinds[i] == atoms[indices[i]].kind) {
-                atoms[indices[i]].kind = sample_distribution(distribution, distribution_length, distribution_total);
-            }
+    if(options.progress_file_name) {
+        progress_file = fopen(options.progress_file_name, "a");
+        if(!progress_file) {
+            fprintf(stderr, "cannot open %s\n", options.progress_file_name);
+            return 1;
         }
-        SolveValue solve_value = solve(2);
-        int new_num_solutions = solve_value.num_solutions;
+    }
+    parse(puzzle, len);
+    if(options.cache_directory) cut_cache_load(options.cache_directory);
+    if(options.batch_count > 0) {
+        int result = generate_batch(puzzle, len, distribution, distribution_length);
+        cut_cache_save();
+        fprintf(stderr, "seed %" PRIu64 "\n", random_seed);
+        if(progress_file) fclose(progress_file);
+        return result;
+    }
 
-        if(new_num_solutions == 1) {
-            break;
-        } else if(1 <= new_num_solutions) {
-            print(1);
-            old_num_solutions = new_num_solutions;
-        } else {
-            for(int i = 0; i < NUM_CHOICES; i++) {
-                atoms[indices[i]].kind = old_kinds[i];
-                if(old_kinds[i] == ATOM_UNSPECIFIED) unspecified_atoms_count++;
-            }
-        }
-        int atom_kinds_count[5] = { };
-        for(int i = 0; i < atoms_count; i++) {
-            atom_kinds_count[atoms[i].kind]++;
-        }
-        printf("\033[34;1H\033[K+ %i %i/%i %i (%i %i %i %i %i)\n", iterations, new_num_solutions, old_num_solutions, cut_edges_count,
-               atom_kinds_count[0], atom_kinds_count[1], atom_kinds_count[2], atom_kinds_count[3], atom_kinds_count[4]);
-        iterations++;
+    if(options.interactive) printf("\033[2J\033[H");
+    GenerateValue value;
+    if(options.threads > 1) {
+        Chain winner = generate_chains(puzzle, len, distribution, distribution_length);
+        value = winner.value;
+    } else {
+        if(options.portfolio > 1) portfolio_start(puzzle, len);
+        value = generate(distribution, distribution_length, 0, 1);
+        if(portfolio.members_count > 0) portfolio_stop();
     }
+    cut_cache_save();
+    if(progress_file) fclose(progress_file);
+    if(!value.unique) return 1;
 
-    system("clear");
-    print(1);
-    printf("\n");
+    if(options.interactive) {
+        printf("\033[2J\033[H");
+        print(1);
+    } else {
+        print_file(stdout);
+    }
+    printf("\n%i connectivity clauses, %zu KB\n", cut_set_live_count(), cut_set_bytes() / 1024);
+    printf("%lli solves, %.2f refinements per solve, %lli cuts added\n", stats.solves,
+           (double) stats.cegar_iterations / max(stats.solves, 1), stats.cuts_added);
+    if(options.threads > 1) printf("found by chain %i of %i\n", chains_winner(), options.threads);
+    printf("seed %" PRIu64 "\n", random_seed);
+    if(portfolio.members_count > 0) portfolio_print_wins();
+    if(options.stats) stats_print(stdout, &stats, options.stats == STATS_JSON);
     FILE* fp = fopen("puzzle.txt", "wb");
     print_file(fp);
     fclose(fp);
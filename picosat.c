@@ -36,6 +36,12 @@ IN THE SOFTWARE.
  */
 #define NADC
 
+/* By default code for 'cardinality constraints' is enabled, since 'NCRD'
+ * is undefined.
+ *
+#define NCRD
+ */
+
 /* By default we enable failed literals, since 'NFL' is undefined.
  *
 #define NFL
@@ -392,6 +398,11 @@ typedef struct Trd Trd;		/* trace data for clauses */
 typedef struct Zhn Zhn;		/* compressed chain (=zain) data */
 typedef unsigned char Znt;	/* compressed antecedent data */
 #endif
+#ifndef NCRD
+typedef struct Crd Crd;		/* cardinality constraint */
+typedef struct Ocr Ocr;		/* occurrence in cardinality constraint */
+typedef struct Ocs Ocs;		/* occurrences of a variable */
+#endif
 
 #ifdef NO_BINARY_CLAUSES
 typedef struct Ltk Ltk;
@@ -486,6 +497,29 @@ struct Trd
 };
 #endif
 
+#ifndef NCRD
+struct Crd
+{
+  int guard;			/* only enforced if guard is true (or zero) */
+  unsigned lower, upper;	/* bounds on the number of true literals */
+  unsigned size;
+  unsigned collect:1;
+  unsigned num_true, num_false;	/* of the propagated literals */
+  int *lits;			/* external literals, since 'lits' moves */
+};
+
+struct Ocr
+{
+  Crd *crd;
+  int lit;			/* literal in 'crd' or its guard */
+};
+
+struct Ocs
+{
+  Ocr *start, *top, *end;
+};
+#endif
+
 struct Blk
 {
 #ifndef NDEBUG
@@ -548,6 +582,9 @@ struct PicoSAT
   Lit **trail, **thead, **eot, **ttail, ** ttail2;
 #ifndef NADC
   Lit **ttailado;
+#endif
+#ifndef NCRD
+  Lit **ttailcrd;
 #endif
   unsigned adecidelevel;
   Lit **als, **alshead, **alstail, **eoals;
@@ -617,6 +654,7 @@ struct PicoSAT
   unsigned lastreduceconflicts;
   unsigned llocked;	/* locked large learned clauses */
   unsigned lrestart;
+  unsigned restartunit;	/* conflicts per restart interval unit */
 #ifdef NLUBY
   unsigned drestart;
   unsigned ddrestart;
@@ -696,6 +734,14 @@ struct PicoSAT
   unsigned adoconflictlimit;
   int addingtoado;
   int adodisabled;
+#endif
+#ifndef NCRD
+  Crd ** crds, ** hcrds, ** eocrds;
+  Ocs * crdocs;
+  unsigned szcrdocs;
+  unsigned lcollectcrds;
+  unsigned long long crdprops;
+  unsigned crdconflicts;
 #endif
   unsigned long long flips;
 #ifdef STATS
@@ -1205,6 +1251,7 @@ init (void * pmgr,
   ps->adoconflictlimit = UINT_MAX;
 #endif
   ps->min_flipped = UINT_MAX;
+  ps->restartunit = MINRESTART;
 
   NEWN (ps->lits, 2 * ps->size_vars);
   NEWN (ps->jwh, 2 * ps->size_vars);
@@ -1477,6 +1524,36 @@ reset_ados (PS * ps)
 
 #endif
 
+#ifndef NCRD
+
+static void
+delete_crd (PS * ps, Crd * c)
+{
+  DELETEN (c->lits, c->size);
+  delete (ps, c, sizeof *c);
+}
+
+static void
+reset_crds (PS * ps)
+{
+  Crd ** p;
+  Ocs * o;
+
+  for (p = ps->crds; p < ps->hcrds; p++)
+    delete_crd (ps, *p);
+
+  DELETEN (ps->crds, ps->eocrds - ps->crds);
+  ps->hcrds = ps->eocrds = 0;
+
+  for (o = ps->crdocs; o < ps->crdocs + ps->szcrdocs; o++)
+    DELETEN (o->start, o->end - o->start);
+
+  DELETEN (ps->crdocs, ps->szcrdocs);
+  ps->szcrdocs = 0;
+}
+
+#endif
+
 static void
 reset (PS * ps)
 {
@@ -1497,6 +1574,9 @@ reset (PS * ps)
 #ifndef NADC
   reset_ados (ps);
 #endif
+#ifndef NCRD
+  reset_crds (ps);
+#endif
 #ifndef NFL
   DELETEN (ps->saved, ps->saved_size);
 #endif
@@ -1552,12 +1632,18 @@ tpush (PS * ps, Lit * lit)
       unsigned ttailcount = ps->ttail - ps->trail;
 #ifndef NADC
       unsigned ttailadocount = ps->ttailado - ps->trail;
+#endif
+#ifndef NCRD
+      unsigned ttailcrdcount = ps->ttailcrd - ps->trail;
 #endif
       ENLARGE (ps->trail, ps->thead, ps->eot);
       ps->ttail = ps->trail + ttailcount;
       ps->ttail2 = ps->trail + ttail2count;
 #ifndef NADC
       ps->ttailado = ps->trail + ttailadocount;
+#endif
+#ifndef NCRD
+      ps->ttailcrd = ps->trail + ttailcrdcount;
 #endif
     }
 
@@ -1800,6 +1886,7 @@ hup (PS * ps, Rnk * v)
 }
 
 static Cls *add_simplified_clause (PS *, int);
+static Lit *import_lit (PS *, int, int);
 
 inline static void
 add_antecedent (PS * ps, Cls * c)
@@ -2647,6 +2734,366 @@ simplify_and_add_original_clause (PS * ps)
     }
 }
 
+#ifndef NCRD
+
+static void
+push_crd_occ (PS * ps, Crd * c, int ilit)
+{
+  unsigned idx = abs (ilit), old;
+  Ocs * o;
+
+  if (idx >= ps->szcrdocs)
+    {
+      old = ps->szcrdocs;
+      ps->szcrdocs = old ? 2 * old : 1;
+      while (idx >= ps->szcrdocs)
+	ps->szcrdocs *= 2;
+      RESIZEN (ps->crdocs, old, ps->szcrdocs);
+      CLRN (ps->crdocs + old, ps->szcrdocs - old);
+    }
+
+  o = ps->crdocs + idx;
+  if (o->top == o->end)
+    ENLARGE (o->start, o->top, o->end);
+
+  o->top->crd = c;
+  o->top->lit = ilit;
+  o->top++;
+}
+
+/* Add the clause justifying a propagation or conflict of 'c' and let
+ * 'add_simplified_clause' do the assignment or set the conflict.  The
+ * reason consists of all literals of 'c' currently assigned to 'val', the
+ * negated guard and the 'forced' literal, if any.
+ */
+static void
+explain_crd (PS * ps, Crd * c, Val val, Lit * forced)
+{
+  unsigned i;
+  Lit * lit;
+
+  assert (ps->ahead == ps->added);
+
+  for (i = 0; i < c->size; i++)
+    {
+      lit = int2lit (ps, c->lits[i]);
+      if (lit->val == val)
+	add_lit (ps, val == TRUE ? NOTLIT (lit) : lit);
+    }
+
+  if (forced)
+    add_lit (ps, forced);
+
+  if (c->guard)
+    add_lit (ps, int2lit (ps, -c->guard));
+
+  add_simplified_clause (ps, 1);
+}
+
+/* Full check of an enabled constraint against the current assignment,
+ * which may contain literals not propagated yet.
+ */
+static void
+propcrd (PS * ps, Crd * c)
+{
+  unsigned i, num_true, num_undef;
+  Lit * lit;
+
+  if (c->guard && int2lit (ps, c->guard)->val != TRUE)
+    return;
+
+  num_true = num_undef = 0;
+  for (i = 0; i < c->size; i++)
+    {
+      lit = int2lit (ps, c->lits[i]);
+      num_true += (lit->val == TRUE);
+      num_undef += (lit->val == UNDEF);
+    }
+
+  if (num_true > c->upper)
+    {
+      ps->crdconflicts++;
+      explain_crd (ps, c, TRUE, 0);
+      return;
+    }
+
+  if (num_true + num_undef < c->lower)
+    {
+      ps->crdconflicts++;
+      explain_crd (ps, c, FALSE, 0);
+      return;
+    }
+
+  if (!num_undef)
+    return;
+
+  if (num_true == c->upper)
+    {
+      for (i = 0; !ps->conflict && i < c->size; i++)
+	{
+	  lit = int2lit (ps, c->lits[i]);
+	  if (lit->val != UNDEF)
+	    continue;
+
+	  ps->crdprops++;
+	  explain_crd (ps, c, TRUE, NOTLIT (lit));
+	}
+    }
+  else if (num_true + num_undef == c->lower)
+    {
+      for (i = 0; !ps->conflict && i < c->size; i++)
+	{
+	  lit = int2lit (ps, c->lits[i]);
+	  if (lit->val != UNDEF)
+	    continue;
+
+	  ps->crdprops++;
+	  explain_crd (ps, c, FALSE, lit);
+	}
+    }
+}
+
+static int
+crd_retired (PS * ps, Crd * c)
+{
+  Lit * guard;
+
+  if (!c->guard)
+    return 0;
+
+  guard = int2lit (ps, c->guard);
+  return guard->val == FALSE && !LIT2VAR (guard)->level;
+}
+
+/* Update the counters of all constraints containing 'v' and only do the
+ * full check if the bound in the direction of the new value is reached.
+ * Constraints retired at the top level are dropped on the way.
+ */
+static void
+propcrds (PS * ps, Var * v)
+{
+  unsigned idx = v - ps->vars;
+  Ocr * p;
+  Ocs * o;
+  Lit * lit;
+  Crd * c;
+  int check;
+
+  assert (!ps->conflict);
+
+  if (idx >= ps->szcrdocs)
+    return;
+
+  /* Counters have to be updated even after a conflict, since 'undo'
+   * decrements them for every propagated variable.
+   */
+  o = ps->crdocs + idx;
+  for (p = o->start; p < o->top; p++)
+    {
+      c = p->crd;
+      if (crd_retired (ps, c))
+	{
+	  *p-- = *--o->top;
+	  continue;
+	}
+
+      lit = int2lit (ps, p->lit);
+      if (p->lit == c->guard)
+	check = (lit->val == TRUE);
+      else if (lit->val == TRUE)
+	check = (++c->num_true >= c->upper);
+      else
+	{
+	  assert (lit->val == FALSE);
+	  check = (c->size - ++c->num_false <= c->lower);
+	}
+
+      if (check && !ps->conflict)
+	propcrd (ps, c);
+    }
+}
+
+static void
+unpropcrds (PS * ps, Var * v)
+{
+  unsigned idx = v - ps->vars;
+  Ocr * p;
+  Ocs * o;
+  Crd * c;
+
+  if (idx >= ps->szcrdocs)
+    return;
+
+  o = ps->crdocs + idx;
+  for (p = o->start; p < o->top; p++)
+    {
+      c = p->crd;
+      if (p->lit == c->guard)
+	continue;
+
+      if (int2lit (ps, p->lit)->val == TRUE)
+	{
+	  assert (c->num_true > 0);
+	  c->num_true--;
+	}
+      else
+	{
+	  assert (c->num_false > 0);
+	  c->num_false--;
+	}
+    }
+}
+
+/* Constraints with a guard fixed to false at the top level can never
+ * propagate again.  Incremental users retire guards this way, so free them
+ * once they make up half of all constraints.
+ */
+static void
+collect_crds (PS * ps)
+{
+  unsigned collect = 0;
+  Crd ** p, ** q, * c;
+  Ocr * r, * s;
+  Ocs * o;
+
+  for (p = ps->crds; p < ps->hcrds; p++)
+    {
+      c = *p;
+      if (!crd_retired (ps, c))
+	continue;
+
+      c->collect = 1;
+      collect++;
+    }
+
+  if (collect)
+    {
+      for (o = ps->crdocs; o < ps->crdocs + ps->szcrdocs; o++)
+	{
+	  s = o->start;
+	  for (r = s; r < o->top; r++)
+	    if (!r->crd->collect)
+	      *s++ = *r;
+	  o->top = s;
+	}
+
+      q = ps->crds;
+      for (p = q; p < ps->hcrds; p++)
+	{
+	  c = *p;
+	  if (c->collect)
+	    delete_crd (ps, c);
+	  else
+	    *q++ = c;
+	}
+      ps->hcrds = q;
+    }
+
+  ps->lcollectcrds = 2 * (ps->hcrds - ps->crds) + 100;
+}
+
+static void
+add_crd (PS * ps, int guard, unsigned lower, unsigned upper, int * lits)
+{
+  unsigned size, i;
+  Lit * lit;
+  Var * v;
+  Crd * c;
+  int * p;
+
+  assert (!ps->LEVEL);
+
+  for (p = lits; *p; p++)
+    ;
+  size = p - lits;
+
+  if ((unsigned)(ps->hcrds - ps->crds) >= ps->lcollectcrds)
+    collect_crds (ps);
+
+  c = new (ps, sizeof *c);
+  c->guard = guard;
+  c->lower = lower;
+  c->upper = upper < size ? upper : size;
+  c->size = size;
+  c->collect = 0;
+  c->num_true = c->num_false = 0;
+  NEWN (c->lits, size);
+
+  if (guard)
+    import_lit (ps, guard, 1);
+
+  for (i = 0; i < size; i++)
+    {
+      v = LIT2VAR (import_lit (ps, lits[i], 1));
+      ABORTIF (v->mark || (guard && v == ps->vars + abs (guard)),
+               "API usage: variable occurs twice in cardinality constraint");
+      v->mark = 1;
+      c->lits[i] = lits[i];
+    }
+
+  for (i = 0; i < size; i++)
+    ps->vars[abs (lits[i])].mark = 0;
+
+  /* The counters of the new constraint cover all assigned literals, so
+   * first propagate pending top level assignments to the old ones.
+   */
+  while (!ps->mtcls && ps->ttailcrd < ps->thead)
+    propcrds (ps, LIT2VAR (*ps->ttailcrd++));
+
+  for (i = 0; i < size; i++)
+    {
+      lit = int2lit (ps, lits[i]);
+      c->num_true += (lit->val == TRUE);
+      c->num_false += (lit->val == FALSE);
+    }
+
+  if (ps->hcrds == ps->eocrds)
+    ENLARGE (ps->crds, ps->hcrds, ps->eocrds);
+
+  *ps->hcrds++ = c;
+
+  if (guard)
+    push_crd_occ (ps, c, guard);
+
+  for (i = 0; i < size; i++)
+    push_crd_occ (ps, c, lits[i]);
+
+  if (!ps->mtcls)
+    propcrd (ps, c);
+}
+
+#ifndef NDEBUG
+
+static void
+crds_satisfied (PS * ps)
+{
+  unsigned i, num_true, num_false;
+  Crd ** p, * c;
+  Lit * lit;
+
+  for (p = ps->crds; p < ps->hcrds; p++)
+    {
+      c = *p;
+      if (c->guard && int2lit (ps, c->guard)->val != TRUE)
+	continue;
+
+      num_true = num_false = 0;
+      for (i = 0; i < c->size; i++)
+	{
+	  lit = int2lit (ps, c->lits[i]);
+	  num_true += (lit->val == TRUE);
+	  num_false += (lit->val == FALSE);
+	}
+
+      assert (c->lower <= num_true && num_true <= c->upper);
+      assert (c->num_true == num_true && c->num_false == num_false);
+    }
+}
+
+#endif
+
+#endif
+
 #ifndef NADC
 
 static void
@@ -3073,6 +3520,10 @@ undo (PS * ps, unsigned new_level)
 	  break;
 	}
 
+#ifndef NCRD
+      if (ps->thead < ps->ttailcrd)
+	unpropcrds (ps, v);
+#endif
       unassign (ps, lit);
     }
 
@@ -3082,6 +3533,9 @@ undo (PS * ps, unsigned new_level)
 #ifndef NADC
   ps->ttailado = ps->thead;
 #endif
+#ifndef NCRD
+  ps->ttailcrd = ps->thead;
+#endif
 
 #ifdef NO_BINARY_CLAUSES
   if (ps->conflict == &ps->cimpl)
@@ -3417,6 +3871,11 @@ bcp_queue_is_empty (PS * ps)
     return 0;
 #endif
 
+#ifndef NCRD
+  if (ps->ttailcrd != ps->thead)
+    return 0;
+#endif
+
   return 1;
 }
 
@@ -4346,6 +4805,14 @@ bcp (PS * ps)
 	  propado (ps, LIT2VAR (*ps->ttailado++));
 	  if (ps->conflict) break;
 	}
+#endif
+#ifndef NCRD
+      else if (ps->ttailcrd < ps->thead)
+	{
+	  if (ps->conflict) break;
+	  propcrds (ps, LIT2VAR (*ps->ttailcrd++));
+	  if (ps->conflict) break;
+	}
 #endif
       else
 	break;		/* all assignments propagated, so break */
@@ -4857,7 +5324,7 @@ inc_lrestart (PS * ps, int skip)
 {
   unsigned delta;
 
-  delta = 100 * luby (++ps->lubycnt);
+  delta = ps->restartunit * luby (++ps->lubycnt);
   ps->lrestart = ps->conflicts + delta;
 
   if (ps->waslubymaxdelta)
@@ -4882,8 +5349,8 @@ init_restart (PS * ps)
   /* TODO: why is it better in incremental usage to have smaller initial
    * outer restart interval?
    */
-  ps->ddrestart = ps->calls > 1 ? MINRESTART : 1000;
-  ps->drestart = MINRESTART;
+  ps->ddrestart = ps->calls > 1 ? ps->restartunit : 1000;
+  ps->drestart = ps->restartunit;
   ps->lrestart = ps->conflicts + ps->drestart;
 #else
   ps->lubycnt = 0;
@@ -4932,7 +5399,7 @@ restart (PS * ps)
     {
       kind = skip ? 'N' : 'R';
       inc_ddrestart (ps);
-      ps->drestart = MINRESTART;
+      ps->drestart = ps->restartunit;
     }
   else  if (skip)
     {
@@ -5378,6 +5845,9 @@ simplify (PS * ps, int forced)
 	    *ps->ttail++ = lit;
 	}
       ps->ttail2 = ps->thead = ps->ttail;
+#ifndef NCRD
+      ps->ttailcrd = ps->thead;
+#endif
 
       for (q = ps->cils; q != ps->cilshead; q++)
 	{
@@ -5427,6 +5897,9 @@ simplify (PS * ps, int forced)
 #ifdef STATS
   ps->srecycled += bytes_collected;
 #endif
+#ifndef NCRD
+  collect_crds (ps);
+#endif
 
   if (ps->cils != ps->cilshead)
     {
@@ -5950,6 +6423,9 @@ SATISFIED:
 #ifndef NDEBUG
 	  original_clauses_satisfied (ps);
 	  assumptions_satisfied (ps);
+#ifndef NCRD
+	  crds_satisfied (ps);
+#endif
 #endif
 	  return PICOSAT_SATISFIABLE;
 	}
@@ -6941,6 +7417,43 @@ picosat_add_ado_lit (PS * ps, int external_lit)
 #endif
 }
 
+void
+picosat_add_card (PS * ps, int guard, int lower, int upper, int * lits)
+{
+#ifndef NCRD
+  if (ps->measurealltimeinlib)
+    enter (ps);
+  else
+    check_ready (ps);
+
+  ABORTIF (ps->ahead > ps->added,
+           "API usage: 'picosat_add' and 'picosat_add_card' mixed");
+  ABORTIF (ps->CLS != ps->clshead,
+           "API usage: 'picosat_add_card' after 'picosat_push'");
+#ifdef TRACE
+  ABORTIF (ps->trace,
+           "API usage: 'picosat_add_card' with tracing enabled");
+#endif
+  ABORTIF (lower < 0 || upper < lower,
+           "API usage: invalid cardinality constraint bounds");
+
+  if (ps->state != READY)
+    reset_incremental_usage (ps);
+
+  add_crd (ps, guard, lower, upper, lits);
+
+  if (ps->measurealltimeinlib)
+    leave (ps);
+#else
+  (void) ps;
+  (void) guard;
+  (void) lower;
+  (void) upper;
+  (void) lits;
+  ABORT ("compiled without cardinality constraint support");
+#endif
+}
+
 static void
 assume (PS * ps, Lit * lit)
 {
@@ -8042,6 +8555,10 @@ picosat_stats (PS * ps)
 #ifndef NADC
    fprintf (ps->out, "%s%u adc conflicts\n", ps->prefix, ps->adoconflicts);
 #endif
+#ifndef NCRD
+   fprintf (ps->out, "%s%llu cardinality propagations, %u conflicts\n",
+           ps->prefix, ps->crdprops, ps->crdconflicts);
+#endif
 #ifdef STATS
    fprintf (ps->out, "%s%llu dereferenced literals\n", ps->prefix, ps->derefs);
 #endif
@@ -8482,6 +8999,12 @@ void picosat_set_interrupt (PicoSAT * ps,
   ps->interrupt.function = interrupted;
 }
 
+void
+picosat_set_restart_interval (PS * ps, unsigned conflicts)
+{
+  ps->restartunit = conflicts ? conflicts : MINRESTART;
+}
+
 int
 picosat_deref_partial (PS * ps, int int_lit) 
 {
@@ -185,6 +185,12 @@ void picosat_message (PicoSAT *, int verbosity_level, const char * fmt, ...);
  */
 void picosat_set_seed (PicoSAT *, unsigned random_number_generator_seed);
 
+/* Set the unit of the restart schedule in conflicts.  The intervals
+ * between restarts are this unit times the Luby sequence.  Smaller units
+ * restart more aggressively.  Zero restores the default of 100.
+ */
+void picosat_set_restart_interval (PicoSAT *, unsigned conflicts);
+
 /* If you ever want to extract cores or proof traces with the current
  * instance of PicoSAT initialized with 'picosat_init', then make sure to
  * call 'picosat_enable_trace_generation' right after 'picosat_init'.   This
@@ -420,6 +426,19 @@ void picosat_assume (PicoSAT *, int lit);
  */
 void picosat_add_ado_lit (PicoSAT *, int);
 
+/*------------------------------------------------------------------------*/
+/* Add a cardinality constraint over the zero terminated list of literals
+ * 'lits': the number of true literals has to be at least 'lower' and at
+ * most 'upper'.  If 'guard' is non zero the constraint is only enforced if
+ * 'guard' is true, which allows to retire it later by adding the unit
+ * clause '-guard' or to enable it through an assumption.  A variable may
+ * occur at most once in 'lits' and not as guard.  The constraint is
+ * propagated natively instead of being translated into clauses.
+ * Justifications for propagations are added as learned clauses.  Can not
+ * be combined with 'picosat_push' or tracing.
+ */
+void picosat_add_card (PicoSAT *, int guard, int lower, int upper, int * lits);
+
 /*------------------------------------------------------------------------*/
 /* Call the main SAT routine.  A negative decision limit sets no limit on
  * the number of decisions.  The return values are as above, e.g.